@@ -7,6 +7,7 @@
  * Copyright (c) 2004-2015, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE     /* for sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
@@ -18,6 +19,11 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 
 #include "mm.h"
@@ -64,9 +70,10 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, ALIGNED } type; /* type of request */
     int index;                        /* index for free() to use later */
     size_t size;                      /* byte size of alloc/realloc request */
+    size_t align;                     /* alignment of aligned alloc request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -82,14 +89,28 @@ typedef struct {
     int *block_rand_base;/* index into random_data, if debug is on */
 } trace_t;
 
+/* An allocator the traces run on, through a table of its functions */
+typedef struct {
+    char name[MAXLINE];
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*memalign)(size_t alignment, size_t size);  /* NULL if none */
+    void (*checkheap)(int verbose);                     /* NULL if none */
+    void (*info)(mm_info_t *info);                      /* NULL if none */
+    int heap;               /* allocates from the memlib.c heap */
+} backend_t;
+
 /*
- * Holds the params to the xxx_speed functions, which are timed by fcyc.
+ * Holds the params to the eval_mm_speed function, which is timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
  * as input.
  */
 typedef struct {
     trace_t *trace;
     range_t *ranges;
+    const backend_t *backend;
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -105,6 +126,13 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t peak;     /* peak heap plus mapped bytes during the trace */
+    size_t heap;     /* heap bytes at the end of the trace */
+    size_t resident; /* heap bytes backed by memory at the end */
+    double mode_secs[2]; /* secs with eager and deferred coalescing (-C) */
+    double mode_util[2]; /* util with eager and deferred coalescing (-C) */
+    double huge_secs[2]; /* secs on base and on huge pages (-H) */
+    mm_info_t info;  /* allocator state at the payload peak (-S) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -141,6 +169,39 @@ int verbose = 1;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 int onetime_flag = 0;
 
+/* compare eager and deferred coalescing per trace (set by -C) */
+static int compare_coalesce = 0;
+
+/* compare base and huge pages per trace (set by -H) */
+static int compare_huge = 0;
+static int huge_backing = MEM_HUGE_OFF;     /* what the heap got */
+
+/* report resident heap memory per trace (set by -r) */
+static int report_resident = 0;
+
+/* report allocator statistics per trace (set by -S) */
+static int report_info = 0;
+static mm_info_t peak_info;     /* taken by eval_mm_util */
+
+/* record the correctness runs into this trace (set by -R) */
+static char *record_file = NULL;
+static mm_info_t record_info;   /* size classes for the histogram */
+
+/* number of threads for the scaling mode, 0 if off (set by -T) */
+static int mt_threads = 0;
+
+/* producer/consumer pairs for the churn mode, 0 if off (set by -W) */
+static int pc_pairs = 0;
+
+/* compare per-object free with region reset (set by -G) */
+static int run_regions = 0;
+
+/* allocators to compare side by side, NULL if off (set by -B) */
+static char *backend_list = NULL;
+
+/* worker processes checking the traces, 1 for none (set by -j) */
+static int jobs = 1;
+
 /* by default, no timeouts */
 static int set_timeout = 0;
 
@@ -179,16 +240,28 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
-/* Routines for evaluating the correctness and speed of libc malloc */
-static int eval_libc_valid(trace_t *trace);
-static void eval_libc_speed(void *ptr);
+/* The C library as a backend */
+static int libc_init(void);
+static void *libc_memalign(size_t alignment, size_t size);
 
 /* Routines for evaluating correctnes, space utilization, and speed
-   of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+   of a malloc package, the student's in mm.c unless told otherwise */
+static int eval_mm_valid(trace_t *trace, const backend_t *b, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, const backend_t *b);
 static void eval_mm_speed(void *ptr);
 
+/* Multithreaded scaling of the mm_mt_ interface in mm-mt.c */
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+                         char **tracefiles, int max_threads, int run_libc);
+static void run_pc_tests(int max_pairs, int run_libc);
+
+/* Request lifecycle benchmark of the regions in mm-region.c */
+static void run_req_tests(void);
+
+/* Side-by-side comparison of several allocators */
+static void run_backend_tests(int num_tracefiles, const char *tracedir,
+                              char **tracefiles, char *list);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
 static void usage(void);
@@ -199,6 +272,15 @@ static void unix_error(const char *fmt, ...)
 static void app_error(const char *fmt, ...)
     __attribute__((format(printf, 1,2), noreturn));
 
+/* The built-in backends: mm.c and the C library */
+static const backend_t mm_backend = {
+    "mm", mm_init, mm_malloc, mm_free, mm_realloc, mm_memalign,
+    mm_checkheap, mm_info, 1
+};
+static const backend_t libc_backend = {
+    "libc", libc_init, malloc, free, realloc, libc_memalign, NULL, NULL, 0
+};
+
 static sigjmp_buf timeout_jmpbuf;
 
 /* Timeout signal handler */
@@ -208,6 +290,187 @@ static void timeout_handler(int sig __attribute__((unused))) {
     longjmp(timeout_jmpbuf, 1);
 }
 
+/*
+ * check_trace - Check trace i for correctness and, unless it fails or
+ *               only correctness counts, measure its utilization. All
+ *               but the timing, which run_tests does
+ */
+static void check_trace(trace_t *trace, int i, stats_t *stats, range_t **ranges)
+{
+    if (verbose > 1)
+        printf("Checking mm_malloc for correctness, ");
+    mm_trace_on = record_file != NULL;
+    stats->valid = eval_mm_valid(trace, &mm_backend, ranges);
+    mm_trace_on = 0;
+    if (record_file)
+        mm_info(&record_info);
+    if (!stats->valid || onetime_flag)
+        return;
+
+    if (verbose > 1)
+        printf("efficiency, ");
+    stats->util = eval_mm_util(trace, i, &mm_backend);
+    printf(".");
+    stats->info = peak_info;
+    stats->peak = mem_peaksize();
+    stats->heap = mem_heapsize();
+    stats->resident = mem_resident();
+
+    /* Both coalescing modes, then restore the default */
+    if (compare_coalesce) {
+        int mode;
+        for (mode = 0; mode < 2; mode++) {
+            mm_mallopt(MM_DEFER_COALESCE, mode);
+            stats->mode_util[mode] = eval_mm_util(trace, i, &mm_backend);
+        }
+        mm_mallopt(MM_DEFER_COALESCE, 0);
+    }
+}
+
+/*
+ * Parallel checking (-j). Worker processes take the traces one at a
+ * time and run check_trace on them, each with the heap of its own
+ * address space and pinned to its own core. Their results land in a
+ * shared mapping. Timing waits until all workers are gone, so the
+ * throughput is measured on a quiet machine as without -j.
+ */
+
+/* The results of one trace... */
+typedef struct {
+    int done;               /* set once stats is complete */
+    int errors;             /* errors found in the trace */
+    stats_t stats;
+} check_t;
+
+/* ... and of all of them */
+typedef struct {
+    int next;               /* next trace to take */
+    size_t size;            /* bytes mapped for the pool */
+    int workers;
+    pid_t *pids;            /* workers not reaped yet, or 0 */
+    check_t traces[];
+} check_pool_t;
+
+/*
+ * pin_worker - Bind worker w to one of the cores we may run on
+ */
+static void pin_worker(int w)
+{
+    cpu_set_t allowed, one;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+    w %= CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed) && w-- == 0) {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            sched_setaffinity(0, sizeof(one), &one);
+            return;
+        }
+}
+
+/*
+ * check_worker - Check traces until none are left, then exit
+ */
+static void check_worker(int w, check_pool_t *pool, int num_tracefiles,
+                         const char *tracedir, char **tracefiles)
+{
+    range_t *ranges = NULL;
+    trace_t *trace;
+    check_t *c;
+    int i;
+
+    /* The progress lines of several workers would only interleave */
+    if (verbose > 1)
+        verbose = 1;
+    pin_worker(w);
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < num_tracefiles) {
+        c = &pool->traces[i];
+        c->errors = errors;
+        mem_init();
+        trace = read_trace(&c->stats, tracedir, tracefiles[i]);
+        strcpy(c->stats.filename, trace->filename);
+        c->stats.ops = trace->num_ops;
+        check_trace(trace, i, &c->stats, &ranges);
+        free_trace(trace);
+        mem_deinit();
+        c->errors = errors - c->errors;
+        __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+    }
+    _exit(0);
+}
+
+/*
+ * check_parallel - Start checking the traces in up to n workers. Return
+ *    the pool the results go to
+ */
+static check_pool_t *check_parallel(int n, int num_tracefiles,
+                                    const char *tracedir, char **tracefiles)
+{
+    size_t size;
+    check_pool_t *pool;
+    pid_t pid;
+    int w;
+
+    if (n > num_tracefiles)
+        n = num_tracefiles;
+    size = sizeof(check_pool_t) + num_tracefiles * sizeof(check_t) + n * sizeof(pid_t);
+    pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED)
+        unix_error("mmap failed in check_parallel");
+    memset(pool, 0, size);
+    pool->size = size;
+    pool->pids = (pid_t *)&pool->traces[num_tracefiles];
+
+    if (verbose > 1)
+        printf("Checking %d traces in %d workers\n", num_tracefiles, n);
+    for (w = 0; w < n; w++) {
+        if ((pid = fork()) < 0)
+            unix_error("fork failed in check_parallel");
+        if (pid == 0)
+            check_worker(w, pool, num_tracefiles, tracedir, tracefiles);
+        pool->pids[w] = pid;
+        pool->workers = w + 1;
+    }
+    return pool;
+}
+
+/*
+ * check_wait - Wait for the workers of pool to finish. Traces whose
+ *    worker died are not done
+ */
+static void check_wait(check_pool_t *pool)
+{
+    int w, status;
+
+    for (w = 0; w < pool->workers; w++) {
+        if (waitpid(pool->pids[w], &status, 0) < 0)
+            unix_error("waitpid failed in check_wait");
+        pool->pids[w] = 0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            printf("\nA worker died, checking its trace again\n");
+    }
+}
+
+/*
+ * check_end - Kill the workers of pool that are still running, after a
+ *    timeout, reap them and unmap the pool
+ */
+static void check_end(check_pool_t *pool)
+{
+    int w;
+
+    for (w = 0; w < pool->workers; w++) {
+        if (pool->pids[w] > 0) {
+            kill(pool->pids[w], SIGKILL);
+            waitpid(pool->pids[w], NULL, 0);
+        }
+    }
+    munmap(pool, pool->size);
+}
+
 /* Run the tests; return the number of tests run (may be less than
    num_tracefiles, if there's a timeout) */
 static void run_tests(int num_tracefiles, const char *tracedir,
@@ -215,6 +478,20 @@ static void run_tests(int num_tracefiles, const char *tracedir,
                       stats_t *mm_stats, range_t *ranges, speed_t *speed_params) {
     volatile int i;
     volatile int timed_out = 0;
+    check_pool_t *volatile pool = NULL;
+
+    /* Optionally check the traces in parallel first */
+    if (setjmp(timeout_jmpbuf) != 0) {
+        timed_out = 1;
+        if (pool) {
+            check_end(pool);
+            pool = NULL;
+        }
+    }
+    if (jobs > 1 && !timed_out && !onetime_flag && !record_file) {
+        pool = check_parallel(jobs, num_tracefiles, tracedir, tracefiles);
+        check_wait(pool);
+    }
 
     for (i=0; i < num_tracefiles; i++) {
         /* initialize simulated memory system in memlib.c *
@@ -232,25 +509,46 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         mm_stats[i].ops = trace->num_ops;
         if(timed_out) {
             mm_stats[i].valid = 0;
+        } else if (pool && pool->traces[i].done) {
+            mm_stats[i] = pool->traces[i].stats;
+            errors += pool->traces[i].errors;
         } else {
-            if (verbose > 1)
-                printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid = eval_mm_valid(trace, &ranges);
-
+            check_trace(trace, i, &mm_stats[i], &ranges);
             if (onetime_flag) {
                 free_trace(trace);
                 return;
             }
         }
         if (mm_stats[i].valid) {
-            if (verbose > 1)
-                printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
+            speed_params->backend = &mm_backend;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+
+            /* Time both coalescing modes, then restore the default */
+            if (compare_coalesce) {
+                int mode;
+                for (mode = 0; mode < 2; mode++) {
+                    mm_mallopt(MM_DEFER_COALESCE, mode);
+                    mm_stats[i].mode_secs[mode] = fsecs(eval_mm_speed, speed_params);
+                }
+                mm_mallopt(MM_DEFER_COALESCE, 0);
+            }
+
+            /* Measure on a heap of base pages and on one of huge pages */
+            if (compare_huge) {
+                int mode;
+                for (mode = 0; mode < 2; mode++) {
+                    mem_deinit();
+                    mem_set_huge(mode ? MEM_HUGE_TLB : MEM_HUGE_OFF);
+                    mem_init();
+                    mm_stats[i].huge_secs[mode] = fsecs(eval_mm_speed, speed_params);
+                }
+                huge_backing = mem_huge();
+                mem_set_huge(MEM_HUGE_OFF);
+            }
         }
 
         free_trace(trace);
@@ -258,6 +556,8 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         /* clean up memory system */
         mem_deinit();
     }
+    if (pool)
+        check_end(pool);
 }
 
 /**************
@@ -291,7 +591,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:B:j:T:W:k:K:P:R:hpVAlDrSCGH")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -332,6 +632,35 @@ int main(int argc, char **argv)
             run_libc = 1;
             break;
 
+        case 'C': /* Compare eager and deferred coalescing */
+            compare_coalesce = 1;
+            break;
+
+        case 'r': /* Report resident versus peak memory */
+            report_resident = 1;
+            break;
+
+        case 'S': /* Report allocator statistics */
+            report_info = 1;
+            break;
+
+        case 'k': /* Sampled heap check of n blocks per call */
+            mm_mallopt(MM_CHECK_SLICE, atoi(optarg));
+            break;
+
+        case 'K': /* Full heap check every n calls */
+            mm_mallopt(MM_CHECK_FULL, atoi(optarg));
+            break;
+
+        case 'P': /* Heap profile sampled every n bytes */
+            mm_mallopt(MM_PROFILE, atoi(optarg));
+            mm_prof_dump_at("mdriver.heap", SIGUSR1);
+            break;
+
+        case 'R': /* Record the requests of the correctness runs */
+            record_file = strdup(optarg);
+            break;
+
         case 'V': /* Increase verbosity level */
             verbose += 1;
             break;
@@ -352,6 +681,38 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'j': /* Check the traces in n workers, 0 for one per core */
+            jobs = atoi(optarg);
+            if (jobs == 0)
+                jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            if (jobs < 1)
+                app_error("-j needs a number of workers, or 0 for one per core");
+            break;
+
+        case 'T': /* Measure scaling from 1 to n threads */
+            mt_threads = atoi(optarg);
+            if (mt_threads < 1)
+                app_error("-T needs a positive thread count");
+            break;
+
+        case 'H': /* Compare base and huge pages */
+            compare_huge = 1;
+            break;
+
+        case 'G': /* Compare per-object free with region reset */
+            run_regions = 1;
+            break;
+
+        case 'B': /* Compare a list of allocators */
+            backend_list = strdup(optarg);
+            break;
+
+        case 'W': /* Producer/consumer churn with 1 to n pairs */
+            pc_pairs = atoi(optarg);
+            if (pc_pairs < 1)
+                app_error("-W needs a positive number of pairs");
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -381,6 +742,26 @@ int main(int argc, char **argv)
         alarm(set_timeout); 
     }
 
+    /*
+     * The scaling mode replaces the usual evaluation
+     */
+    if (mt_threads > 0) {
+        run_mt_tests(num_tracefiles, tracedir, tracefiles, mt_threads, run_libc);
+        exit(errors ? 1 : 0);
+    }
+    if (pc_pairs > 0) {
+        run_pc_tests(pc_pairs, run_libc);
+        exit(errors ? 1 : 0);
+    }
+    if (run_regions) {
+        run_req_tests();
+        exit(errors ? 1 : 0);
+    }
+    if (backend_list) {
+        run_backend_tests(num_tracefiles, tracedir, tracefiles, backend_list);
+        exit(errors ? 1 : 0);
+    }
+
     /*
      * Optionally run and evaluate the libc malloc package
      */
@@ -399,12 +780,13 @@ int main(int argc, char **argv)
 
             if (verbose > 1)
                 printf("Checking libc malloc for correctness, ");
-            libc_stats[i].valid = eval_libc_valid(trace);
+            libc_stats[i].valid = eval_mm_valid(trace, &libc_backend, &ranges);
             if (libc_stats[i].valid) {
                 speed_params.trace = trace;
+                speed_params.backend = &libc_backend;
                 if (verbose > 1)
                     printf("and performance.\n");
-                libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+                libc_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
             }
             free_trace(trace);
         }
@@ -428,6 +810,11 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
+    if (record_file) {
+        if (mm_trace_start(record_file) < 0)
+            unix_error("Could not open %s for recording", record_file);
+        mm_trace_on = 0;
+    }
     run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
               ranges, &speed_params);
 
@@ -448,6 +835,112 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Optionally finish the recorded trace and show what it allocates */
+    if (record_file) {
+        unsigned long allocs[MM_INFO_CLASSES];
+        size_t bytes[MM_INFO_CLASSES];
+
+        mm_trace_hist(allocs, bytes);
+        if (mm_trace_stop() < 0)
+            unix_error("Could not write %s", record_file);
+        printf("Recorded the correctness runs into %s. Allocations by size class:\n",
+               record_file);
+        printf("%9s%10s%10s\n", "class", "allocs", "KB");
+        for (i = 0; i < record_info.classes; i++)
+            if (allocs[i])
+                printf("%8zu+%10lu%10zu\n", record_info.class_min[i], allocs[i],
+                       bytes[i] >> 10);
+        printf("\n");
+    }
+
+    /* Optionally show both coalescing modes side by side */
+    if (compare_coalesce && !onetime_flag) {
+        double ops = 0, secs[2] = {0, 0};
+        printf("Eager versus deferred coalescing:\n");
+        printf("%10s%10s%10s%10s  %s\n", "eager", "deferred", "eager", "deferred", "");
+        printf("%10s%10s%10s%10s  %s\n", "Kops", "Kops", "util", "util", "trace");
+        for (i=0; i < num_tracefiles; i++) {
+            if (!mm_stats[i].valid)
+                continue;
+            printf("%10.0f%10.0f%9.0f%%%9.0f%%  %s\n",
+                   mm_stats[i].ops / 1e3 / mm_stats[i].mode_secs[0],
+                   mm_stats[i].ops / 1e3 / mm_stats[i].mode_secs[1],
+                   mm_stats[i].mode_util[0] * 100.0, mm_stats[i].mode_util[1] * 100.0,
+                   mm_stats[i].filename);
+            ops += mm_stats[i].ops;
+            secs[0] += mm_stats[i].mode_secs[0];
+            secs[1] += mm_stats[i].mode_secs[1];
+        }
+        printf("%10.0f%10.0f%20s  %s\n\n", ops / 1e3 / secs[0], ops / 1e3 / secs[1], "", "total");
+    }
+
+    /* Optionally show both page sizes side by side */
+    if (compare_huge && !onetime_flag) {
+        double ops = 0, secs[2] = {0, 0};
+        printf("Base versus huge pages, the heap got %s:\n",
+               huge_backing == MEM_HUGE_TLB ? "MAP_HUGETLB pages" :
+               huge_backing == MEM_HUGE_THP ? "transparent huge pages" :
+               "no huge pages");
+        printf("%10s%10s%10s  %s\n", "base", "huge", "", "");
+        printf("%10s%10s%10s  %s\n", "Kops", "Kops", "speedup", "trace");
+        for (i=0; i < num_tracefiles; i++) {
+            if (!mm_stats[i].valid)
+                continue;
+            printf("%10.0f%10.0f%10.2f  %s\n",
+                   mm_stats[i].ops / 1e3 / mm_stats[i].huge_secs[0],
+                   mm_stats[i].ops / 1e3 / mm_stats[i].huge_secs[1],
+                   mm_stats[i].huge_secs[0] / mm_stats[i].huge_secs[1],
+                   mm_stats[i].filename);
+            ops += mm_stats[i].ops;
+            secs[0] += mm_stats[i].huge_secs[0];
+            secs[1] += mm_stats[i].huge_secs[1];
+        }
+        printf("%10.0f%10.0f%10.2f  %s\n\n", ops / 1e3 / secs[0], ops / 1e3 / secs[1],
+               secs[0] / secs[1], "total");
+    }
+
+    /* Optionally show how much of the peak footprint is still held */
+    if (report_resident && !onetime_flag) {
+        printf("Memory at the end of each trace, in KB:\n");
+        printf("%10s%10s%10s%7s  %s\n", "peak", "heap", "resident", "kept", "trace");
+        for (i=0; i < num_tracefiles; i++) {
+            if (!mm_stats[i].valid)
+                continue;
+            printf("%10zu%10zu%10zu%6.0f%%  %s\n",
+                   mm_stats[i].peak >> 10, mm_stats[i].heap >> 10,
+                   mm_stats[i].resident >> 10,
+                   mm_stats[i].peak ? 100.0 * mm_stats[i].resident / mm_stats[i].peak : 0,
+                   mm_stats[i].filename);
+        }
+        printf("\n");
+    }
+
+    /* Optionally show the allocator statistics */
+    if (report_info && !onetime_flag) {
+        printf("Allocator state at the payload peak, in KB:\n");
+        printf("%9s%9s%9s%9s%6s%9s%9s%7s  %s\n", "in use", "free", "largest",
+               "parked", "frag", "extends", "fits", "probes", "trace");
+        for (i=0; i < num_tracefiles; i++) {
+            mm_info_t *in = &mm_stats[i].info;
+            if (!mm_stats[i].valid)
+                continue;
+            printf("%9zu%9zu%9zu%9zu%5.0f%%%9lu%9lu%7.1f  %s\n",
+                   in->in_use >> 10, in->free_bytes >> 10, in->largest_free >> 10,
+                   in->parked >> 10, in->fragmentation * 100.0, in->extends,
+                   in->fits, in->fits ? (double)in->probes / in->fits : 0,
+                   mm_stats[i].filename);
+            if (verbose > 1) {
+                int c;
+                printf("    free bytes by class:");
+                for (c = 0; c < in->classes; c++)
+                    if (in->class_free[c])
+                        printf(" %zu+:%zu", in->class_min[c], in->class_free[c]);
+                printf("\n");
+            }
+        }
+        printf("\n");
+    }
+
     /* Optionally compare the performance of mm and libc */
     if (run_libc) {
         printf("Comparison with libc malloc: mm/libc = %.0f Kops / %.0f Kops = %.2f\n", 
@@ -606,11 +1099,13 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or of a
+       region from mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_in_map(lo, hi)) {
         malloc_error(trace, opnum,
-                     "Payload (%p:%p) lies outside heap (%p:%p)",
+                     "Payload (%p:%p) lies outside heap (%p:%p) and mapped regions",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
         return 0;
     }
@@ -754,7 +1249,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     FILE *tracefile;
     trace_t *trace;
     char type[MAXLINE];
-    int index, size;
+    int index, size, align;
     int max_index = 0;
     int op_index;
 
@@ -824,6 +1319,17 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
+        case 'm':
+            r = fscanf(tracefile, "%u %u %u", &index, &size, &align);
+            if (r == 3 && (align == 0 || (align & (align - 1))))
+                app_error("%s: alignment %u is not a power of two\n",
+                          trace->filename, align);
+            trace->ops[op_index].type = ALIGNED;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].align = align;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         case 'f':
             r = fscanf(tracefile, "%ud", &index);
             trace->ops[op_index].type = FREE;
@@ -873,13 +1379,15 @@ static void free_trace(trace_t *trace)
 
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
- * and throughput of the libc and mm malloc packages.
+ * and throughput of a malloc package: mm.c, libc or any other backend.
  **********************************************************************/
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * eval_mm_valid - Check malloc package b for correctness. Blocks of a
+ *    backend outside the memlib.c heap are checked for alignment and
+ *    their contents, but not for overlaps
  */
-static int eval_mm_valid(trace_t *trace, range_t **ranges)
+static int eval_mm_valid(trace_t *trace, const backend_t *b, range_t **ranges)
 {
     int i;
     int index;
@@ -889,13 +1397,14 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
     char *p;
 
     /* Reset the heap and free any records in the range list */
-    mem_reset_brk();
+    if (b->heap)
+        mem_reset_brk();
     clear_ranges(ranges);
     reinit_trace(trace);
 
-    /* Call the mm package's init function */
-    if (mm_init() < 0) {
-        malloc_error(trace, 0, "mm_init failed.");
+    /* Call the package's init function */
+    if (b->init() < 0) {
+        malloc_error(trace, 0, "%s: mm_init failed.", b->name);
         return 0;
     }
 
@@ -904,11 +1413,11 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
-        if(debug_mode == DBG_EXPENSIVE) {
+        if(debug_mode == DBG_EXPENSIVE && b->checkheap) {
             range_t *r;
                         
             /* Let the students check their own heap */
-            mm_checkheap(verbose);
+            b->checkheap(verbose);
 
             /* Now check that all our allocated blocks have the right data */
             r = *ranges;
@@ -921,10 +1430,22 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case ALIGNED: /* mm_memalign */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
-                malloc_error(trace, i, "mm_malloc failed.");
+            if (trace->ops[i].type == ALIGNED) {
+                if ((p = b->memalign(trace->ops[i].align, size)) == NULL) {
+                    malloc_error(trace, i, "%s: mm_memalign failed.", b->name);
+                    return 0;
+                }
+                if ((size_t)p % trace->ops[i].align) {
+                    malloc_error(trace, i, "%s: payload address (%p) not aligned "
+                                 "to %zu bytes", b->name, p, trace->ops[i].align);
+                    return 0;
+                }
+            }
+            else if ((p = b->malloc(size)) == NULL) {
+                malloc_error(trace, i, "%s: mm_malloc failed.", b->name);
                 return 0;
             }
 
@@ -933,7 +1454,12 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
              * to the range list if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
-            if (add_range(ranges, p, size, trace, i, index) == 0)
+            if (!b->heap && !IS_ALIGNED(p)) {
+                malloc_error(trace, i, "%s: payload address (%p) not aligned "
+                             "to %d bytes", b->name, p, ALIGNMENT);
+                return 0;
+            }
+            if (b->heap && add_range(ranges, p, size, trace, i, index) == 0)
                 return 0;
 
             /* Remember region */
@@ -949,23 +1475,24 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
             /* Call the student's realloc */
             oldp = trace->blocks[index];
-            newp = mm_realloc(oldp, size);
+            newp = b->realloc(oldp, size);
             if( (newp == NULL) && (size != 0) ) {
-                malloc_error(trace, i, "mm_realloc failed.");
+                malloc_error(trace, i, "%s: mm_realloc failed.", b->name);
                 return 0;
             }
-            if( (newp != NULL) && (size == 0) ) {
-                malloc_error(trace, i, "mm_realloc with size 0 returned "
-                             "non-NULL.");
+            if( (newp != NULL) && (size == 0) && b->heap ) {
+                malloc_error(trace, i, "%s: mm_realloc with size 0 returned "
+                             "non-NULL.", b->name);
                 return 0;
             }
 
 
             /* Remove the old region from the range list */
-            remove_range(ranges, oldp);
+            if (b->heap)
+                remove_range(ranges, oldp);
 
             /* Check new block for correctness and add it to range list */
-            if (size > 0) {
+            if (size > 0 && b->heap) {
                 if(add_range(ranges, newp, size, trace, i, index) == 0)
                     return 0;
             }
@@ -992,9 +1519,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
                 p = 0;
             } else {
                 p = trace->blocks[index];
-                remove_range(ranges, p);
+                if (b->heap)
+                    remove_range(ranges, p);
             }
-            mm_free(p);
+            b->free(p);
             break;
 
         default:
@@ -1008,7 +1536,8 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 }
 
 /*
- * eval_mm_util - Evaluate the space utilization of the student's package
+ * eval_mm_util - Evaluate the space utilization of malloc package b,
+ *   which must allocate from the memlib.c heap.
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
@@ -1019,7 +1548,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, const backend_t *b)
 {
     int i;
     int index;
@@ -1033,19 +1562,22 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
-    if (mm_init() < 0)
-        app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+    if (b->init() < 0)
+        app_error("trace %d: %s: mm_init failed in eval_mm_util", tracenum, b->name);
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case ALIGNED: /* mm_memalign */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
-                app_error("trace %d: mm_malloc failed in eval_mm_util",
-                          tracenum);
+            if ((p = trace->ops[i].type == ALIGNED ?
+                 b->memalign(trace->ops[i].align, size) :
+                 b->malloc(size)) == NULL) {
+                app_error("trace %d: %s: mm_malloc failed in eval_mm_util",
+                          tracenum, b->name);
             }
 
             /* Remember region and size */
@@ -1061,9 +1593,9 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             oldsize = trace->block_sizes[index];
 
             oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0) {
-                app_error("trace %d: mm_realloc failed in eval_mm_util",
-                          tracenum);
+            if ((newp = b->realloc(oldp,newsize)) == NULL && newsize != 0) {
+                app_error("trace %d: %s: mm_realloc failed in eval_mm_util",
+                          tracenum, b->name);
             }
 
             /* Remember region and size */
@@ -1083,7 +1615,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            b->free(p);
 
             total_size -= size;
             break;
@@ -1093,32 +1625,46 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                       tracenum);
         }
 
-        /* update the high-water mark */
-        max_total_size = (total_size > max_total_size) ?
-            total_size : max_total_size;
+        /* update the high-water mark, and see what the allocator looks
+           like at that point */
+        if (total_size > max_total_size) {
+            max_total_size = total_size;
+            if (report_info && b->info)
+                b->info(&peak_info);
+        }
     }
 
-    printf(".");
+    /* The counters cover the whole trace */
+    if (report_info && b->info) {
+        mm_info_t end;
+        b->info(&end);
+        peak_info.extends = end.extends;
+        peak_info.fits = end.fits;
+        peak_info.probes = end.probes;
+    }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* The footprint is the peak of heap plus mapped bytes */
+    return ((double)max_total_size / (double)mem_peaksize());
 }
 
 
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ *    to measure the running time of a malloc package.
  */
 static void eval_mm_speed(void *ptr)
 {
     int i, index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    const backend_t *b = ((speed_t *)ptr)->backend;
     reinit_trace(trace);
 
     /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (mm_init() < 0)
-        app_error("mm_init failed in eval_mm_speed");
+    if (b->heap)
+        mem_reset_brk();
+    if (b->init() < 0)
+        app_error("%s: mm_init failed in eval_mm_speed", b->name);
 
     /* Interpret each trace request */
     for (i = 0;  i < trace->num_ops;  i++)
@@ -1127,8 +1673,16 @@ static void eval_mm_speed(void *ptr)
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
+            if ((p = b->malloc(size)) == NULL)
+                app_error("%s: mm_malloc error in eval_mm_speed", b->name);
+            trace->blocks[index] = p;
+            break;
+
+        case ALIGNED: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = b->memalign(trace->ops[i].align, size)) == NULL)
+                app_error("%s: mm_memalign error in eval_mm_speed", b->name);
             trace->blocks[index] = p;
             break;
 
@@ -1136,8 +1690,8 @@ static void eval_mm_speed(void *ptr)
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
             oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
+            if ((newp = b->realloc(oldp,newsize)) == NULL && newsize != 0)
+                app_error("%s: mm_realloc error in eval_mm_speed", b->name);
             trace->blocks[index] = newp;
             break;
 
@@ -1148,7 +1702,7 @@ static void eval_mm_speed(void *ptr)
             } else {
                 block = trace->blocks[index];
             }
-            mm_free(block);
+            b->free(block);
             break;
 
         default:
@@ -1156,101 +1710,758 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/**********************************************************************
+ * Multithreaded scaling mode (-T). Every thread replays the whole trace
+ * on its own set of blocks through the thread-safe mm_mt_ interface,
+ * then frees whatever its neighbour left allocated, which exercises
+ * the cross-thread free path.
+ **********************************************************************/
+
+/* The allocator a scaling run goes through */
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} mt_funcs_t;
+
+/* Per-thread state of a scaling run */
+typedef struct mt_arg {
+    const trace_t *trace;
+    const mt_funcs_t *funcs;
+    char **blocks;               /* this thread's blocks... */
+    size_t *block_sizes;         /* ... and their payload sizes */
+    struct mt_arg *neighbour;    /* thread whose leftovers we free */
+    pthread_barrier_t *barrier;
+    struct timespec start, end;  /* when this thread's replay ran */
+    int failed;                  /* MT_NOMEM or MT_LOST */
+} mt_arg_t;
+
+#define MT_NOMEM    1   /* the allocator ran out of memory */
+#define MT_LOST     2   /* a block was corrupted or handed out twice */
+#define MT_RUNS     3   /* runs per measurement, the fastest counts */
+
+static const mt_funcs_t mt_mm_funcs = {
+    "mm-mt", mm_mt_malloc, mm_mt_free, mm_mt_realloc
+};
+static const mt_funcs_t mt_libc_funcs = {
+    "libc", malloc, free, realloc
+};
+
 /*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
+ * mt_tag - Mark the first and last byte of a block with its index so
+ *          that a block handed to two threads at once is noticed
  */
-static int eval_libc_valid(trace_t *trace)
+static void mt_tag(char *p, size_t size, int index)
 {
-    int i, newsize;
-    char *p, *newp, *oldp;
+    p[0] = (char)index;
+    p[size-1] = (char)index;
+}
 
-    reinit_trace(trace);
+static int mt_tagged(const char *p, size_t size, int index)
+{
+    return p[0] == (char)index && p[size-1] == (char)index;
+}
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+/*
+ * mt_replay - Thread body: replay the trace between the first two
+ *             barriers, then free the neighbour's leftover blocks
+ */
+static void *mt_replay(void *ptr)
+{
+    mt_arg_t *arg = ptr;
+    const trace_t *trace = arg->trace;
+    const mt_funcs_t *f = arg->funcs;
+    char **blocks = arg->blocks;
+    size_t *sizes = arg->block_sizes;
+    int i, index;
+    size_t size;
+    char *p;
 
-        case ALLOC: /* malloc */
-            if ((p = malloc(trace->ops[i].size)) == NULL) {
-                malloc_error(trace, i, "libc malloc failed");
-                unix_error("System message");
+    pthread_barrier_wait(arg->barrier);
+    clock_gettime(CLOCK_MONOTONIC, &arg->start);
+    for (i = 0; i < trace->num_ops && !arg->failed; i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+        case ALLOC:
+        case ALIGNED:   /* mm_mt_ has no aligned entry point */
+            if ((p = f->malloc(size)) == NULL) {
+                arg->failed |= MT_NOMEM;
+                break;
             }
-            trace->blocks[trace->ops[i].index] = p;
+            mt_tag(p, size, index);
+            blocks[index] = p;
+            sizes[index] = size;
             break;
 
-        case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[trace->ops[i].index];
-            if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
-                malloc_error(trace, i, "libc realloc failed");
-                unix_error("System message");
+        case REALLOC:
+            if (blocks[index] && !mt_tagged(blocks[index], sizes[index], index))
+                arg->failed |= MT_LOST;
+            if ((p = f->realloc(blocks[index], size)) == NULL && size != 0) {
+                arg->failed |= MT_NOMEM;
+                break;
             }
-            trace->blocks[trace->ops[i].index] = newp;
+            if (p && p[0] != (char)index && blocks[index])
+                arg->failed |= MT_LOST;
+            if (p)
+                mt_tag(p, size, index);
+            blocks[index] = p;
+            sizes[index] = size;
             break;
 
-        case FREE: /* free */
-            if(trace->ops[i].index >= 0) {
-                free(trace->blocks[trace->ops[i].index]);
-            } else {
-                free(0);
+        case FREE:
+            if (index < 0) {
+                f->free(NULL);
+                break;
             }
+            if (blocks[index] && !mt_tagged(blocks[index], sizes[index], index))
+                arg->failed |= MT_LOST;
+            f->free(blocks[index]);
+            blocks[index] = NULL;
             break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &arg->end);
+    pthread_barrier_wait(arg->barrier);
+
+    mt_arg_t *nb = arg->neighbour;
+    for (i = 0; i < trace->num_ids; i++) {
+        if (nb->blocks[i]) {
+            if (!mt_tagged(nb->blocks[i], nb->block_sizes[i], i))
+                arg->failed |= MT_LOST;
+            f->free(nb->blocks[i]);
+        }
+    }
+    return NULL;
+}
 
-        default:
-            app_error("invalid operation type  in eval_libc_valid");
+/*
+ * eval_mt_speed - Replay trace in nthreads threads at once and return
+ *                 the aggregate throughput in ops/sec, or minus the
+ *                 MT_ failure bits
+ */
+static double eval_mt_speed(const trace_t *trace, const mt_funcs_t *funcs,
+                            int nthreads)
+{
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    mt_arg_t *args = calloc(nthreads, sizeof(mt_arg_t));
+    pthread_barrier_t barrier;
+    struct timespec start, end;
+    int i, failed = 0;
+
+    if (tids == NULL || args == NULL)
+        unix_error("calloc failed in eval_mt_speed");
+
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        args[i].trace = trace;
+        args[i].funcs = funcs;
+        args[i].blocks = calloc(trace->num_ids, sizeof(char *));
+        args[i].block_sizes = calloc(trace->num_ids, sizeof(size_t));
+        args[i].neighbour = &args[(i + 1) % nthreads];
+        args[i].barrier = &barrier;
+        if (args[i].blocks == NULL || args[i].block_sizes == NULL)
+            unix_error("calloc failed in eval_mt_speed");
+    }
+    for (i = 0; i < nthreads; i++)
+        if (pthread_create(&tids[i], NULL, mt_replay, &args[i]) != 0)
+            unix_error("pthread_create failed in eval_mt_speed");
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    /* The run lasts from the first thread starting to the last finishing */
+    start = args[0].start;
+    end = args[0].end;
+    for (i = 0; i < nthreads; i++) {
+        if (args[i].start.tv_sec < start.tv_sec || (args[i].start.tv_sec == start.tv_sec &&
+                                                    args[i].start.tv_nsec < start.tv_nsec))
+            start = args[i].start;
+        if (args[i].end.tv_sec > end.tv_sec || (args[i].end.tv_sec == end.tv_sec &&
+                                                args[i].end.tv_nsec > end.tv_nsec))
+            end = args[i].end;
+        failed |= args[i].failed;
+        free(args[i].blocks);
+        free(args[i].block_sizes);
+    }
+    pthread_barrier_destroy(&barrier);
+    free(args);
+    free(tids);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return failed ? -failed : (double)nthreads * trace->num_ops / secs;
+}
+
+/*
+ * eval_mt_best - Best throughput of MT_RUNS scaling runs. For mm-mt each
+ *                run starts from an empty heap, as in eval_mm_speed
+ */
+static double eval_mt_best(const trace_t *trace, const mt_funcs_t *funcs,
+                           int nthreads)
+{
+    double best = 0, tput = 0;
+    int i, mm = funcs == &mt_mm_funcs;
+
+    if (mm)
+        mem_init();
+    for (i = 0; i < MT_RUNS; i++) {
+        if (mm) {
+            mem_reset_brk();
+            if (mm_mt_init() < 0)
+                app_error("mm_mt_init failed in eval_mt_best");
         }
+        if ((tput = eval_mt_speed(trace, funcs, nthreads)) < 0)
+            break;
+        if (tput > best)
+            best = tput;
     }
+    if (mm)
+        mem_deinit();
+    return tput < 0 ? tput : best;
+}
 
-    return 1;
+/*
+ * print_mt_result - One throughput column pair of the scaling table
+ */
+static void print_mt_result(double tput, double base)
+{
+    if (tput == -MT_NOMEM)
+        printf("%12s%8s", "no memory", "--");
+    else if (tput < 0)
+        printf("%12s%8s", "FAILED", "--");
+    else
+        printf("%12.0f%8.2f", tput / 1e3, base > 0 ? tput / base : 0);
 }
 
 /*
- * eval_libc_speed - This is the function that is used by fcyc() to
- *    measure the running time of the libc malloc package on the set
- *    of traces.
+ * run_mt_tests - Print the throughput of mm-mt, and of libc if asked,
+ *                for 1, 2, 4, ... up to max_threads threads per trace.
+ *                Lost or corrupted blocks count as errors
  */
-static void eval_libc_speed(void *ptr)
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+                         char **tracefiles, int max_threads, int run_libc)
 {
-    int i;
-    int index, size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
+    stats_t stats;
+    double base_mm = 0, base_libc = 0, mm, libc = 0;
+    int i, n;
+
+    printf("\nMultithreaded scaling, each thread replays the whole trace:\n");
+    printf("%-24s%8s%12s%8s", "trace", "threads", "mm Kops", "scale");
+    if (run_libc)
+        printf("%12s%8s", "libc Kops", "scale");
+    printf("\n");
+
+    for (i = 0; i < num_tracefiles; i++) {
+        trace_t *trace = read_trace(&stats, tracedir, tracefiles[i]);
+
+        for (n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+            mm = eval_mt_best(trace, &mt_mm_funcs, n);
+            if (run_libc)
+                libc = eval_mt_best(trace, &mt_libc_funcs, n);
+            if (n == 1) {
+                base_mm = mm;
+                base_libc = libc;
+            }
 
-    reinit_trace(trace);
+            printf("%-24s%8d", tracefiles[i], n);
+            print_mt_result(mm, base_mm);
+            if (run_libc)
+                print_mt_result(libc, base_libc);
+            printf("\n");
+            if (mm < 0 && mm != -MT_NOMEM)
+                errors++;
+            if (n == max_threads)
+                break;
+        }
+        free_trace(trace);
+    }
+}
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
-        case ALLOC: /* malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = malloc(size)) == NULL)
-                unix_error("malloc failed in eval_libc_speed");
-            trace->blocks[index] = p;
+/**********************************************************************
+ * Producer/consumer churn (-W). In each pair of threads the producer
+ * allocates blocks of random sizes, mostly small, and passes them
+ * through a ring to the consumer, which checks and frees them. Every
+ * free therefore happens in another thread than the malloc.
+ **********************************************************************/
+
+#define PC_RING     256         /* blocks in flight per pair */
+#define PC_BLOCKS   (1 << 18)   /* blocks passed per pair and run */
+#define PC_LARGE    16          /* one block in PC_LARGE is up to 4 KB */
+
+/* State of one producer/consumer pair */
+typedef struct {
+    const mt_funcs_t *funcs;
+    unsigned seed;              /* for the block sizes, not 0 */
+    char *ring[PC_RING];
+    size_t sizes[PC_RING];
+    unsigned head;              /* blocks produced, written by the producer */
+    unsigned tail;              /* blocks consumed, written by the consumer */
+    pthread_barrier_t *barrier;
+    struct timespec start, end; /* when the consumer started and finished */
+    int failed;                 /* MT_NOMEM or MT_LOST, set by both threads */
+} __attribute__((aligned(64))) pc_pair_t;
+
+/*
+ * pc_produce - Producer body: allocate and tag PC_BLOCKS blocks
+ */
+static void *pc_produce(void *ptr)
+{
+    pc_pair_t *pair = ptr;
+    unsigned seed = pair->seed, i;
+    size_t size;
+    char *p;
+
+    pthread_barrier_wait(pair->barrier);
+    for (i = 0; i < PC_BLOCKS; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        size = seed % PC_LARGE ? 8 + (seed >> 8) % 249 : 257 + (seed >> 8) % 3840;
+        if ((p = pair->funcs->malloc(size)) == NULL) {
+            __atomic_fetch_or(&pair->failed, MT_NOMEM, __ATOMIC_RELAXED);
+            size = 0;
+        }
+        else
+            mt_tag(p, size, i);
+        while (i - __atomic_load_n(&pair->tail, __ATOMIC_ACQUIRE) == PC_RING)
+            sched_yield();
+        pair->ring[i % PC_RING] = p;
+        pair->sizes[i % PC_RING] = size;
+        __atomic_store_n(&pair->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * pc_consume - Consumer body: check and free PC_BLOCKS blocks
+ */
+static void *pc_consume(void *ptr)
+{
+    pc_pair_t *pair = ptr;
+    unsigned i;
+    char *p;
+
+    pthread_barrier_wait(pair->barrier);
+    clock_gettime(CLOCK_MONOTONIC, &pair->start);
+    for (i = 0; i < PC_BLOCKS; i++) {
+        while (__atomic_load_n(&pair->head, __ATOMIC_ACQUIRE) == i)
+            sched_yield();
+        p = pair->ring[i % PC_RING];
+        if (p && !mt_tagged(p, pair->sizes[i % PC_RING], i))
+            __atomic_fetch_or(&pair->failed, MT_LOST, __ATOMIC_RELAXED);
+        __atomic_store_n(&pair->tail, i + 1, __ATOMIC_RELEASE);
+        pair->funcs->free(p);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pair->end);
+    return NULL;
+}
+
+/*
+ * eval_pc_speed - Run npairs producer/consumer pairs at once and return
+ *                 the aggregate throughput in mallocs and frees per sec,
+ *                 or minus the MT_ failure bits
+ */
+static double eval_pc_speed(const mt_funcs_t *funcs, int npairs)
+{
+    pthread_t *tids = calloc(2 * npairs, sizeof(pthread_t));
+    pc_pair_t *pairs;
+    pthread_barrier_t barrier;
+    struct timespec start, end;
+    int i, failed = 0;
+
+    if (tids == NULL || posix_memalign((void **)&pairs, 64, npairs * sizeof(pc_pair_t)))
+        unix_error("allocation failed in eval_pc_speed");
+    memset(pairs, 0, npairs * sizeof(pc_pair_t));
+
+    pthread_barrier_init(&barrier, NULL, 2 * npairs);
+    for (i = 0; i < npairs; i++) {
+        pairs[i].funcs = funcs;
+        pairs[i].seed = 2 * i + 1;
+        pairs[i].barrier = &barrier;
+        if (pthread_create(&tids[2*i], NULL, pc_produce, &pairs[i]) != 0 ||
+            pthread_create(&tids[2*i+1], NULL, pc_consume, &pairs[i]) != 0)
+            unix_error("pthread_create failed in eval_pc_speed");
+    }
+    for (i = 0; i < 2 * npairs; i++)
+        pthread_join(tids[i], NULL);
+
+    start = pairs[0].start;
+    end = pairs[0].end;
+    for (i = 0; i < npairs; i++) {
+        if (pairs[i].start.tv_sec < start.tv_sec || (pairs[i].start.tv_sec == start.tv_sec &&
+                                                     pairs[i].start.tv_nsec < start.tv_nsec))
+            start = pairs[i].start;
+        if (pairs[i].end.tv_sec > end.tv_sec || (pairs[i].end.tv_sec == end.tv_sec &&
+                                                 pairs[i].end.tv_nsec > end.tv_nsec))
+            end = pairs[i].end;
+        failed |= pairs[i].failed;
+    }
+    pthread_barrier_destroy(&barrier);
+    free(pairs);
+    free(tids);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return failed ? -failed : 2.0 * npairs * PC_BLOCKS / secs;
+}
+
+/*
+ * eval_pc_best - Best throughput of MT_RUNS churn runs, each from an
+ *                empty heap for mm-mt
+ */
+static double eval_pc_best(const mt_funcs_t *funcs, int npairs)
+{
+    double best = 0, tput = 0;
+    int i, mm = funcs == &mt_mm_funcs;
+
+    if (mm)
+        mem_init();
+    for (i = 0; i < MT_RUNS; i++) {
+        if (mm) {
+            mem_reset_brk();
+            if (mm_mt_init() < 0)
+                app_error("mm_mt_init failed in eval_pc_best");
+        }
+        if ((tput = eval_pc_speed(funcs, npairs)) < 0)
             break;
+        if (tput > best)
+            best = tput;
+    }
+    if (mm)
+        mem_deinit();
+    return tput < 0 ? tput : best;
+}
 
-        case REALLOC: /* realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
-                unix_error("realloc failed in eval_libc_speed\n");
+/*
+ * run_pc_tests - Print the churn throughput of mm-mt, and of libc if
+ *                asked, for 1, 2, 4, ... up to max_pairs pairs
+ */
+static void run_pc_tests(int max_pairs, int run_libc)
+{
+    double base_mm = 0, base_libc = 0, mm, libc = 0;
+    int n;
+
+    printf("\nProducer/consumer churn, every block is freed by another thread:\n");
+    printf("%8s%12s%8s", "pairs", "mm Kops", "scale");
+    if (run_libc)
+        printf("%12s%8s", "libc Kops", "scale");
+    printf("\n");
+
+    for (n = 1; ; n = n * 2 < max_pairs ? n * 2 : max_pairs) {
+        mm = eval_pc_best(&mt_mm_funcs, n);
+        if (run_libc)
+            libc = eval_pc_best(&mt_libc_funcs, n);
+        if (n == 1) {
+            base_mm = mm;
+            base_libc = libc;
+        }
 
-            trace->blocks[index] = newp;
+        printf("%8d", n);
+        print_mt_result(mm, base_mm);
+        if (run_libc)
+            print_mt_result(libc, base_libc);
+        printf("\n");
+        if (mm < 0 && mm != -MT_NOMEM)
+            errors++;
+        if (n == max_pairs)
             break;
+    }
+}
 
-        case FREE: /* free */
-            index = trace->ops[i].index;
-            if(index >= 0) {
-                block = trace->blocks[index];
-                free(block);
-            } else {
-                free(0);
+/**********************************************************************
+ * Request lifecycle (-G). A synthetic server handles REQ_COUNT requests.
+ * Each allocates REQ_MIN to REQ_MAX objects, the middle third of them
+ * in an inner scope that closes before the request ends, and every
+ * REQ_SESSION-th request leaves a session object behind that lives to
+ * the end. The objects of a request die either one by one through
+ * mm_free or all at once with a region of mm-region.c.
+ **********************************************************************/
+
+#define REQ_COUNT   20000
+#define REQ_MIN     16
+#define REQ_MAX     128
+#define REQ_SESSION 16
+#define REQ_LARGE   32      /* one object in REQ_LARGE is up to 2 KB */
+
+/* One request lifecycle run */
+typedef struct {
+    int region;             /* allocate the objects from a region */
+    double objects;         /* objects allocated */
+    int failed;             /* out of memory or an object was overwritten */
+} req_arg_t;
+
+/*
+ * req_next - Next number of the request generator
+ */
+static unsigned req_next(unsigned *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/*
+ * req_free - Check that objects lo to hi still carry their index, and
+ *            free them unless a region does
+ */
+static void req_free(req_arg_t *arg, char **objs, int lo, int hi)
+{
+    for (int j = lo; j < hi; j++) {
+        if (objs[j][0] != (char)j)
+            arg->failed = 1;
+        if (!arg->region)
+            mm_free(objs[j]);
+    }
+}
+
+/*
+ * eval_req_speed - Run the requests on a fresh heap
+ */
+static void eval_req_speed(void *ptr)
+{
+    req_arg_t *arg = ptr;
+    char *objs[REQ_MAX];
+    unsigned seed = 1, size;
+    mm_region_t *r = NULL;
+    mm_region_mark_t inner = { NULL, NULL, NULL, NULL };
+    int i, j, n;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_req_speed");
+    if (arg->region && (r = mm_region_create()) == NULL)
+        app_error("mm_region_create failed in eval_req_speed");
+
+    arg->objects = 0;
+    for (i = 0; i < REQ_COUNT && !arg->failed; i++) {
+        n = REQ_MIN + req_next(&seed) % (REQ_MAX - REQ_MIN + 1);
+        for (j = 0; j < n; j++) {
+            if (j == n / 3 && r)
+                inner = mm_region_mark(r);
+            if (j == 2 * n / 3) {
+                req_free(arg, objs, n / 3, j);
+                if (r)
+                    mm_region_release(r, inner);
             }
-            break;
+            size = req_next(&seed);
+            size = size % REQ_LARGE ? 16 + (size >> 8) % 241 : 257 + (size >> 8) % 1792;
+            objs[j] = r ? mm_region_alloc(r, size) : mm_malloc(size);
+            if (objs[j] == NULL) {
+                arg->failed = 1;
+                return;
+            }
+            objs[j][0] = (char)j;
         }
+        req_free(arg, objs, 0, n / 3);
+        req_free(arg, objs, 2 * n / 3, n);
+        if (r)
+            mm_region_reset(r);
+        if (i % REQ_SESSION == 0 && mm_malloc(64 + req_next(&seed) % 449) == NULL)
+            arg->failed = 1;
+        arg->objects += n;
+    }
+}
+
+/*
+ * run_req_tests - Print the throughput and peak heap of the request
+ *                 lifecycle with per-object free and with regions
+ */
+static void run_req_tests(void)
+{
+    req_arg_t arg;
+    double secs;
+
+    printf("\nRequest lifecycle, %d requests of %d to %d objects:\n",
+           REQ_COUNT, REQ_MIN, REQ_MAX);
+    printf("%-12s%12s%10s%10s\n", "free by", "Kobjects/s", "secs", "peak KB");
+
+    mem_init();
+    for (int region = 0; region <= 1; region++) {
+        memset(&arg, 0, sizeof(arg));
+        arg.region = region;
+        secs = fsecs(eval_req_speed, &arg);
+        printf("%-12s", region ? "region" : "mm_free");
+        if (arg.failed) {
+            printf("%12s\n", "FAILED");
+            errors++;
+            continue;
+        }
+        printf("%12.0f%10.6f%10zu\n", arg.objects / secs / 1e3, secs,
+               mem_peaksize() >> 10);
+    }
+    mem_deinit();
+}
+
+/**********************************************************************
+ * Backend comparison (-B). Every trace runs on each allocator of a
+ * comma-separated list, through a table of its functions, and one
+ * table shows the utilization and throughput of all of them. "mm" is
+ * mm.c and "libc" the C library; any other name is a shared object,
+ * such as mm-naive.so from the Makefile, which is opened with dlopen
+ * and must export mm_init, mm_malloc, mm_free and mm_realloc. It gets
+ * mem_sbrk and the rest of memlib.c from the driver.
+ **********************************************************************/
+
+#define BACKEND_MAX 8
+
+/* Results of one backend on one trace */
+typedef struct {
+    int valid;              /* 0 if failed, -1 if it could not run */
+    double util;            /* only if the backend uses the heap */
+    double secs;
+} backend_stats_t;
+
+/*
+ * libc_init - The C library needs no initialization
+ */
+static int libc_init(void)
+{
+    return 0;
+}
+
+/*
+ * libc_memalign - memalign through posix_memalign
+ */
+static void *libc_memalign(size_t alignment, size_t size)
+{
+    void *p;
+
+    return posix_memalign(&p, alignment, size) == 0 ? p : NULL;
+}
+
+/*
+ * backend_open - Fill in backend b by name: one of the built-in ones or
+ *                a shared object. Exits if the object cannot be used
+ */
+static void backend_open(backend_t *b, const char *name)
+{
+    char path[MAXLINE];
+    const char *base;
+    void *so;
+
+    if (!strcmp(name, mm_backend.name)) {
+        *b = mm_backend;
+        return;
+    }
+    if (!strcmp(name, libc_backend.name)) {
+        *b = libc_backend;
+        return;
+    }
+    memset(b, 0, sizeof(*b));
+
+    /* dlopen searches the library path unless the name has a slash */
+    snprintf(path, sizeof(path), "%s%s", strchr(name, '/') ? "" : "./", name);
+    if ((so = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL)
+        app_error("Could not load backend %s: %s\n", name, dlerror());
+    b->init = (int (*)(void))dlsym(so, "mm_init");
+    b->malloc = (void *(*)(size_t))dlsym(so, "mm_malloc");
+    b->free = (void (*)(void *))dlsym(so, "mm_free");
+    b->realloc = (void *(*)(void *, size_t))dlsym(so, "mm_realloc");
+    b->memalign = (void *(*)(size_t, size_t))dlsym(so, "mm_memalign");
+    if (!b->init || !b->malloc || !b->free || !b->realloc)
+        app_error("Backend %s lacks mm_init, mm_malloc, mm_free or mm_realloc\n",
+                  name);
+    b->heap = 1;
+
+    /* Name it after the file, without directory and suffix */
+    base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+    snprintf(b->name, sizeof(b->name), "%s", base);
+    if (strlen(b->name) > 3 && !strcmp(b->name + strlen(b->name) - 3, ".so"))
+        b->name[strlen(b->name) - 3] = '\0';
+}
+
+/*
+ * print_backend_result - One cell of the comparison table
+ */
+static void print_backend_result(const backend_t *b, const backend_stats_t *s,
+                                 double ops)
+{
+    if (s->valid < 0)
+        printf("%6s%8s", "-", "-");
+    else if (!s->valid)
+        printf("%14s", "FAILED");
+    else if (b->heap)
+        printf("%5.0f%%%8.0f", s->util * 100.0, ops / 1e3 / s->secs);
+    else
+        printf("%6s%8.0f", "-", ops / 1e3 / s->secs);
+}
+
+/*
+ * run_backend_tests - Run every trace on each backend of the list and
+ *    print their utilization and Kops side by side. A backend without
+ *    mm_memalign skips the traces that need it, shown as "-"
+ */
+static void run_backend_tests(int num_tracefiles, const char *tracedir,
+                              char **tracefiles, char *list)
+{
+    backend_t backends[BACKEND_MAX];
+    backend_stats_t s[BACKEND_MAX], total[BACKEND_MAX];
+    int counted[BACKEND_MAX];
+    speed_t arg;
+    range_t *ranges = NULL;
+    stats_t stats;
+    trace_t *trace;
+    double ops[BACKEND_MAX];
+    char *name;
+    int i, j, n = 0, aligned;
+
+    for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (n == BACKEND_MAX)
+            app_error("-B takes at most %d backends\n", BACKEND_MAX);
+        backend_open(&backends[n++], name);
+    }
+    memset(total, 0, sizeof(total));
+    memset(counted, 0, sizeof(counted));
+    memset(ops, 0, sizeof(ops));
+
+    printf("\nBackend comparison, utilization and Kops per trace:\n");
+    for (j = 0; j < n; j++)
+        printf("%14s", backends[j].name);
+    printf("\n");
+    for (j = 0; j < n; j++)
+        printf("%6s%8s", "util", "Kops");
+    printf("  %s\n", "trace");
+
+    mem_init();
+    for (i = 0; i < num_tracefiles; i++) {
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        for (aligned = 0, j = 0; j < trace->num_ops; j++)
+            aligned |= trace->ops[j].type == ALIGNED;
+
+        /* Run them all first, so that errors do not split the row */
+        for (j = 0; j < n; j++) {
+            memset(&s[j], 0, sizeof(s[j]));
+            if (aligned && backends[j].memalign == NULL)
+                s[j].valid = -1;
+            else if ((s[j].valid = eval_mm_valid(trace, &backends[j], &ranges))) {
+                if (backends[j].heap)
+                    s[j].util = eval_mm_util(trace, i, &backends[j]);
+                arg.trace = trace;
+                arg.ranges = ranges;
+                arg.backend = &backends[j];
+                s[j].secs = fsecs(eval_mm_speed, &arg);
+                total[j].util += s[j].util;
+                total[j].secs += s[j].secs;
+                ops[j] += trace->num_ops;
+                counted[j]++;
+            }
+        }
+        for (j = 0; j < n; j++)
+            print_backend_result(&backends[j], &s[j], trace->num_ops);
+        printf("  %s\n", trace->filename);
+        free_trace(trace);
+    }
+    clear_ranges(&ranges);
+    mem_deinit();
+
+    /* Averages over the traces each backend ran */
+    for (j = 0; j < n; j++) {
+        total[j].valid = counted[j] ? 1 : -1;
+        if (counted[j])
+            total[j].util /= counted[j];
+        print_backend_result(&backends[j], &total[j], ops[j]);
     }
+    printf("  %s\n\n", "total");
 }
 
 /*************************************
@@ -1442,4 +2653,17 @@ static void usage(void)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-j <n>     Check traces in n workers pinned to cores, 0 for one per core.\n");
+    fprintf(stderr, "\t-T <n>     Measure throughput scaling from 1 to n threads.\n");
+    fprintf(stderr, "\t-W <n>     Measure producer/consumer churn with 1 to n thread pairs.\n");
+    fprintf(stderr, "\t-B <list>  Compare allocators, e.g. mm,libc,mm-naive.so.\n");
+    fprintf(stderr, "\t-G         Compare per-object free with region reset per request.\n");
+    fprintf(stderr, "\t-r         Report resident versus peak memory per trace.\n");
+    fprintf(stderr, "\t-S         Report allocator statistics per trace.\n");
+    fprintf(stderr, "\t-k <n>     Check n heap blocks on every allocator call.\n");
+    fprintf(stderr, "\t-K <n>     Check the whole heap every n allocator calls.\n");
+    fprintf(stderr, "\t-P <n>     Sample every n bytes into heap profile mdriver.heap.\n");
+    fprintf(stderr, "\t-R <file>  Record the correctness runs as trace <file>.\n");
+    fprintf(stderr, "\t-C         Compare eager and deferred coalescing per trace.\n");
+    fprintf(stderr, "\t-H         Compare a heap of base pages with one of huge pages.\n");
 }
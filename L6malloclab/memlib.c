@@ -3,6 +3,7 @@
  *						allows us to interleave calls from the student's malloc package 
  *						with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -12,6 +13,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -20,20 +22,82 @@
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static char *zero_lo;			/* heap bytes from here up read as zero */
+static int huge_mode;			/* backing asked for by mem_set_huge */
+static int huge;				/* backing mem_init got */
+static char *fault_hi;			/* heap pages below here are prefaulted */
+static pthread_mutex_t brk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Regions handed out by mem_map, outside the simulated heap */
+#define MAX_MAPS 4096
+static struct {
+	char *lo;					/* first byte of the region */
+	size_t size;				/* length in bytes, a multiple of the page size */
+} maps[MAX_MAPS];
+static int num_maps;
+static size_t map_bytes;		/* total size of all mapped regions */
+static size_t peak_bytes;		/* high-water mark of heap plus mapped bytes */
+
+static void unmap_all(void);
+static int find_map(void *lo);
+static void update_peak(void);
+static char *release_pages(void *lo, void *hi);
+static void prefault(void);
+
+/* Huge pages are assumed to be 2 MB, the size on x86-64 */
+#define HUGE_PAGE (1 << 21)
+
+/* Unit in which heap pages can be given back: hugetlb pages only whole */
+#define RELEASE_PAGE ((size_t)(huge == MEM_HUGE_TLB ? HUGE_PAGE : mem_pagesize()))
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model. The heap is backed by
+ *		huge pages if mem_set_huge asked for them: MEM_HUGE_TLB maps it
+ *		with MAP_HUGETLB and falls back to MEM_HUGE_THP, which marks it
+ *		for transparent huge pages, when the system has none reserved
  */
 void mem_init(void){
 	int dev_zero = open("/dev/zero", O_RDWR);
-	heap = mmap((void *)0x800000000, /* suggested start*/
-			MAX_HEAP,				/* length */
-			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
-			dev_zero,				/* fd */
-			0);						/* offset (dunno) */
+
+	huge = huge_mode;
+	heap = MAP_FAILED;
+	if (huge == MEM_HUGE_TLB &&
+		(heap = mmap((void *)0x800000000, MAX_HEAP, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) == MAP_FAILED)
+		huge = MEM_HUGE_THP;
+	if (huge == MEM_HUGE_THP &&
+		((heap = mmap((void *)0x800000000, MAX_HEAP, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED ||
+		 madvise(heap, MAX_HEAP, MADV_HUGEPAGE) < 0))
+		huge = MEM_HUGE_OFF;
+	if (heap == MAP_FAILED)
+		heap = mmap((void *)0x800000000, /* suggested start*/
+				MAX_HEAP,				/* length */
+				PROT_WRITE,				/* permissions */
+				MAP_PRIVATE,			/* private or shared? */
+				dev_zero,				/* fd */
+				0);						/* offset (dunno) */
+	close(dev_zero);
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
+	zero_lo = heap;
+	fault_hi = heap;
+	unmap_all();
+}
+
+/*
+ * mem_set_huge - choose the backing of the heaps made by mem_init from
+ *		now on: MEM_HUGE_OFF, MEM_HUGE_THP or MEM_HUGE_TLB
+ */
+void mem_set_huge(int mode) {
+	huge_mode = mode;
+}
+
+/*
+ * mem_huge - return the backing the current heap got from mem_init
+ */
+int mem_huge(void) {
+	return huge;
 }
 
 /* 
@@ -41,35 +105,183 @@ void mem_init(void){
  */
 void mem_deinit(void){
 	munmap(heap, MAX_HEAP);
+	unmap_all();
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *		and release every mapped region
  */
 void mem_reset_brk(){
 	mem_brk = heap;
+	unmap_all();
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		this model, the heap is shrunk with mem_sbrk_shrink only. Safe to
+ *		call from several threads. The simulated heap has its own
+ *		mapping, so the real break is left alone: libc may own the
+ *		memory above it, and a shrink could never give it back.
  */
 void *mem_sbrk(int incr) {
+	pthread_mutex_lock(&brk_lock);
 	char *old_brk = mem_brk;
 
-    // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
-            sbrk(incr) == (void *) -1) {
+	if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+		pthread_mutex_unlock(&brk_lock);
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 		return (void *)-1;
 	}
 
 	mem_brk += incr;
+	if (mem_brk > zero_lo)
+		zero_lo = mem_brk;
+	if (huge && mem_brk > fault_hi)
+		prefault();
+	update_peak();
+	pthread_mutex_unlock(&brk_lock);
 	return (void *)old_brk;
 }
 
+/*
+ * mem_sbrk_shrink - shrink the heap by decr bytes and hand the pages past
+ *		the new break back to the system. Returns the old break
+ */
+void *mem_sbrk_shrink(size_t decr) {
+	pthread_mutex_lock(&brk_lock);
+	char *old_brk = mem_brk;
+
+	if (decr > (size_t)(mem_brk - heap)) {
+		pthread_mutex_unlock(&brk_lock);
+		errno = EINVAL;
+		fprintf(stderr, "ERROR: mem_sbrk_shrink failed. Shrunk below the heap start...\n");
+		return (void *)-1;
+	}
+	mem_brk -= decr;
+	char *hi = (char *)(((size_t)old_brk + RELEASE_PAGE - 1) & ~(RELEASE_PAGE - 1));
+	char *released = release_pages(mem_brk, hi < mem_max_addr ? hi : mem_max_addr);
+	if (released && released < zero_lo)
+		zero_lo = released;
+	if (released && released < fault_hi)
+		fault_hi = released;
+	pthread_mutex_unlock(&brk_lock);
+	return (void *)old_brk;
+}
+
+/*
+ * mem_release - model of madvise(MADV_DONTNEED): give the whole pages
+ *		within lo:hi back to the system. They read as zero when touched
+ *		again
+ */
+void mem_release(void *lo, void *hi) {
+	release_pages(lo, hi);
+}
+
+/*
+ * mem_zero_lo - return the address from which on the heap area is known
+ *		to read as zero: above the highest break since mem_init, or in
+ *		pages given back by shrinking the heap. mem_reset_brk does not
+ *		clear the heap, so it leaves the address where it is
+ */
+void *mem_zero_lo(void) {
+	return (void *)zero_lo;
+}
+
+/*
+ * mem_map - model of mmap for allocations kept outside the heap. Maps
+ *		size bytes, rounded up to whole pages, and returns the start
+ *		address of the region, or NULL when out of memory
+ */
+void *mem_map(size_t size) {
+	char *lo;
+
+	size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+	pthread_mutex_lock(&brk_lock);
+	if (num_maps == MAX_MAPS ||
+		(lo = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		pthread_mutex_unlock(&brk_lock);
+		errno = ENOMEM;
+		fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+		return NULL;
+	}
+	maps[num_maps].lo = lo;
+	maps[num_maps].size = size;
+	num_maps++;
+	map_bytes += size;
+	update_peak();
+	pthread_mutex_unlock(&brk_lock);
+	return lo;
+}
+
+/*
+ * mem_remap - model of mremap: resize the region mapped at p to size
+ *		bytes, moving it if needed. Returns the new start address, or
+ *		NULL if p was not mapped or there is no memory left
+ */
+void *mem_remap(void *p, size_t size) {
+	char *lo;
+	int i;
+
+	size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+	pthread_mutex_lock(&brk_lock);
+	if ((i = find_map(p)) < 0 ||
+		(lo = mremap(p, maps[i].size, size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+		pthread_mutex_unlock(&brk_lock);
+		errno = ENOMEM;
+		return NULL;
+	}
+	map_bytes += size - maps[i].size;
+	maps[i].lo = lo;
+	maps[i].size = size;
+	update_peak();
+	pthread_mutex_unlock(&brk_lock);
+	return lo;
+}
+
+/*
+ * mem_unmap - release the region mapped at p. Returns 0 on success and
+ *		-1 if p is not the start of a mapped region
+ */
+int mem_unmap(void *p) {
+	int i;
+
+	pthread_mutex_lock(&brk_lock);
+	if ((i = find_map(p)) < 0) {
+		pthread_mutex_unlock(&brk_lock);
+		return -1;
+	}
+	munmap(maps[i].lo, maps[i].size);
+	map_bytes -= maps[i].size;
+	maps[i] = maps[--num_maps];
+	pthread_mutex_unlock(&brk_lock);
+	return 0;
+}
+
+/*
+ * mem_guard - model of mprotect(PROT_NONE): make the size bytes at lo,
+ *		whole pages within a mapped region, fault on any access
+ */
+int mem_guard(void *lo, size_t size) {
+	return mprotect(lo, size, PROT_NONE);
+}
+
+/*
+ * mem_in_map - return true iff lo:hi lies within one mapped region
+ */
+int mem_in_map(void *lo, void *hi) {
+	int i, found = 0;
+
+	pthread_mutex_lock(&brk_lock);
+	for (i = 0; i < num_maps && !found; i++)
+		found = (char *)lo >= maps[i].lo && (char *)hi < maps[i].lo + maps[i].size;
+	pthread_mutex_unlock(&brk_lock);
+	return found;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -91,9 +303,110 @@ size_t mem_heapsize() {
 	return (size_t)((void *)mem_brk - (void *)heap);
 }
 
+/*
+ * mem_mapsize() - returns the number of bytes in mapped regions
+ */
+size_t mem_mapsize() {
+	return map_bytes;
+}
+
+/*
+ * mem_resident() - returns the number of heap bytes backed by memory,
+ *		as reported by mincore
+ */
+size_t mem_resident() {
+	size_t page = mem_pagesize();
+	size_t len = (mem_heapsize() + page - 1) & ~(page - 1);
+	size_t i, count = 0;
+	unsigned char *vec;
+
+	if (len == 0)
+		return 0;
+	if ((vec = malloc(len / page)) == NULL || mincore(heap, len, vec) < 0) {
+		free(vec);
+		return 0;
+	}
+	for (i = 0; i < len / page; i++)
+		count += vec[i] & 1;
+	free(vec);
+	return count * page;
+}
+
+/*
+ * mem_peaksize() - returns the largest heap plus mapped size seen since
+ *		the heap was last reset
+ */
+size_t mem_peaksize() {
+	return peak_bytes;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
 size_t mem_pagesize(){
 	return (size_t)getpagesize();
 }
+
+/*
+ * The remaining routines are internal helper routines
+ */
+
+/* unmap_all - release every mapped region and restart the peak */
+static void unmap_all(void) {
+	while (num_maps > 0) {
+		num_maps--;
+		munmap(maps[num_maps].lo, maps[num_maps].size);
+	}
+	map_bytes = 0;
+	peak_bytes = mem_brk - heap;
+}
+
+/* find_map - index of the region starting at lo, or -1 */
+static int find_map(void *lo) {
+	int i;
+
+	for (i = num_maps - 1; i >= 0; i--)
+		if (maps[i].lo == (char *)lo)
+			return i;
+	return -1;
+}
+
+/* update_peak - account for growth of the heap or the mapped regions */
+static void update_peak(void) {
+	size_t total = (size_t)(mem_brk - heap) + map_bytes;
+
+	if (total > peak_bytes)
+		peak_bytes = total;
+}
+
+/* prefault - fault in the heap up to the huge page holding the break,
+   so that growing the heap costs one fault per huge page */
+static void prefault(void) {
+	char *hi = (char *)(((size_t)mem_brk + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1));
+	volatile char *p;
+
+	if (hi > mem_max_addr)
+		hi = mem_max_addr;
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(fault_hi, hi - fault_hi, MADV_POPULATE_WRITE) == 0) {
+		fault_hi = hi;
+		return;
+	}
+#endif
+	for (p = fault_hi; p < hi; p += mem_pagesize())
+		*p = *p;
+	fault_hi = hi;
+}
+
+/* release_pages - madvise away the whole pages within lo:hi, in units
+   of RELEASE_PAGE. Return where the released pages start, or NULL if
+   none were released */
+static char *release_pages(void *lo, void *hi) {
+	size_t page = RELEASE_PAGE;
+	char *start = (char *)(((size_t)lo + page - 1) & ~(page - 1));
+	char *end = (char *)((size_t)hi & ~(page - 1));
+
+	if (start >= end || madvise(start, end - start, MADV_DONTNEED) < 0)
+		return NULL;
+	return start;
+}
@@ -1,11 +1,29 @@
 #include <unistd.h>
 
+/* Backing of the heap, see mem_set_huge */
+#define MEM_HUGE_OFF    0       /* base pages */
+#define MEM_HUGE_THP    1       /* transparent huge pages */
+#define MEM_HUGE_TLB    2       /* MAP_HUGETLB, else transparent huge pages */
+
 void mem_init(void);               
+void mem_set_huge(int mode);
+int mem_huge(void);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void *mem_sbrk_shrink(size_t decr);
+void *mem_map(size_t size);
+void *mem_remap(void *p, size_t size);
+int mem_unmap(void *p);
+int mem_guard(void *lo, size_t size);
+int mem_in_map(void *lo, void *hi);
+void mem_release(void *lo, void *hi);
+void *mem_zero_lo(void);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_peaksize(void);
+size_t mem_resident(void);
 size_t mem_pagesize(void);
 
@@ -0,0 +1,514 @@
+/*
+ * mm-mt.c - Thread-safe front end for the allocator in mm.c.
+ *
+ * mm.c keeps its state in globals and is not reentrant, so every call
+ * into it is made with heap_lock held. To keep threads off that lock,
+ * each thread owns a thread cache (tcache): a list of free objects per
+ * size class for requests of up to MT_MAX bytes. Classes are MT_GRAIN
+ * bytes apart up to MT_SMALL and MT_SPLIT to a power of two above. All
+ * tcaches share the one heap of mm.c. An empty list is refilled with
+ * MT_BATCH objects under a single lock acquisition, and a list holding
+ * more than MT_CACHE_MAX objects gives half of them back to the heap.
+ *
+ * Every block starts with an MT_HDR byte header holding its class and,
+ * for cached classes, the index of the tcache that allocated it. A thread
+ * frees objects of its own tcache straight into it. Objects of another
+ * tcache are pushed onto that tcache's remote queue, a lock-free stack
+ * which its owner empties with one atomic exchange when a list runs dry.
+ * Since nobody pops single entries the stack is free of ABA.
+ *
+ * A list that grows past MT_CACHE_MAX, for instance from remote frees,
+ * hands whole batches of MT_BATCH objects to the depot of its class, a
+ * stack shared by all tcaches. A refill that finds nothing in the remote
+ * queue pops a batch from the depot before it takes heap_lock. Single
+ * pops can race with a pop and push of the same batch, so a depot head
+ * carries a tag that every operation bumps next to the heap offset of
+ * its first batch, and the compare-and-swap fails on a stale head.
+ * Objects stay allocated in mm.c while they move between tcaches and
+ * depots; they are only coalesced once a full depot sends them back.
+ *
+ * Uncached blocks are freed under heap_lock. When another thread holds
+ * it, the block goes on a deferred list instead. The holder frees the
+ * whole list before it lets go of the lock, and takes the lock back if
+ * a block was deferred while it did so. The thread that deferred the
+ * block tries the lock once more in case the holder left in between.
+ *
+ * Tcaches outlive their threads: on exit a thread returns its objects to
+ * the depots and the heap and releases its tcache to the next new thread,
+ * which also inherits any remote frees that arrive in the meantime.
+ * Threads beyond the first MT_TCACHES go straight to the heap.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MT_HDR          8       /* block header: class, tcache or size */
+#define MT_GRAIN        16      /* small classes are MT_GRAIN bytes apart */
+#define MT_SMALL_SHIFT  8       /* small classes go up to 256 bytes */
+#define MT_SMALL        (1 << MT_SMALL_SHIFT)
+#define MT_SPLIT_SHIFT  2       /* 4 classes per power of two above */
+#define MT_SPLIT        (1 << MT_SPLIT_SHIFT)
+#define MT_MAX_SHIFT    12      /* largest request served from a tcache */
+#define MT_MAX          (1 << MT_MAX_SHIFT)
+#define MT_CLASSES      (MT_SMALL / MT_GRAIN + \
+                         (MT_MAX_SHIFT - MT_SMALL_SHIFT) * MT_SPLIT)
+#define MT_LARGE        MT_CLASSES      /* class of uncached blocks */
+#define MT_TCACHES      64
+#define MT_BATCH        32      /* objects fetched per refill */
+#define MT_CACHE_MAX    128     /* trim a cache beyond this many objects */
+#define MT_DEPOT_MAX    16      /* batches a depot holds at most */
+
+/* Header fields of block ptr bp. The second word is the owning tcache of
+ * a cached object and the requested size of an MT_LARGE block */
+#define MT_CLS(bp)      (*(unsigned *)((char *)(bp) - MT_HDR))
+#define MT_TCACHE(bp)   (*(unsigned *)((char *)(bp) - MT_HDR + 4))
+#define MT_SIZE(bp)     MT_TCACHE(bp)
+
+/* Free objects in tcaches and remote queues are linked through their
+ * first payload word. The first object of a batch in a depot links to
+ * the next batch through its second word */
+#define MT_LINK(bp)     (*(void **)(bp))
+#define MT_NEXT_BATCH(bp) (((void **)(bp))[1])
+
+/* Depot heads: tag in the high word, heap offset of the top batch, or 0
+ * if the depot is empty, in the low word */
+#define DEPOT_PTR(head) ((unsigned)(head) ? mt_base + (unsigned)(head) : NULL)
+#define DEPOT_HEAD(tag, bp) \
+    ((uint64_t)(tag) << 32 | ((bp) ? (unsigned)((char *)(bp) - mt_base) : 0))
+
+/* Per-thread allocation state, one cache line apart */
+typedef struct {
+    void *bins[MT_CLASSES];         /* cached free objects per class */
+    unsigned count[MT_CLASSES];     /* number of objects in bins */
+    void *remote;                   /* objects freed by other threads */
+    unsigned gen;                   /* mt_gen when adopted */
+    int in_use;                     /* owned by a live thread */
+} __attribute__((aligned(64))) tcache_t;
+
+/* Shared batches of one class */
+typedef struct {
+    uint64_t head;                  /* tagged top of the stack */
+    int batches;                    /* batches on the stack, roughly */
+} __attribute__((aligned(64))) depot_t;
+
+/* Global variables */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static tcache_t tcaches[MT_TCACHES];
+static depot_t depots[MT_CLASSES];
+static char *mt_base;                   /* depot offsets count from here */
+static void *deferred;                  /* uncached blocks left to free */
+static unsigned mt_gen;                 /* bumped by every mm_mt_init */
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;        /* runs tcache_release on exit */
+
+static __thread tcache_t *my_tcache;    /* NULL if none was free */
+static __thread unsigned my_gen;        /* heap generation of my_tcache */
+
+/* Function prototypes for internal helper routines */
+static int size_class(size_t size);
+static size_t class_size(int cls);
+static void make_key(void);
+static tcache_t *get_tcache(void);
+static void tcache_release(void *arg);
+static void *tcache_refill(tcache_t *tc, int cls);
+static void tcache_trim(tcache_t *tc, int cls, unsigned keep);
+static void remote_push(tcache_t *tc, void *bp);
+static int depot_push(int cls, char *batch);
+static char *depot_pop(int cls);
+static void heap_lock_acquire(void);
+static void heap_lock_release(void);
+static void free_deferred(void);
+static void *heap_malloc(size_t size);
+
+/*
+ * mm_mt_init - Initialize the heap and forget all tcaches. Must not run
+ *              concurrently with any other mm_mt_ call
+ */
+int mm_mt_init(void) {
+    int ret;
+
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&heap_lock);
+    memset(tcaches, 0, sizeof(tcaches));
+    memset(depots, 0, sizeof(depots));
+    deferred = NULL;
+    mt_gen++;
+    ret = mm_init();
+    mt_base = mem_heap_lo();
+    heap_lock_release();
+    return ret;
+}
+
+/*
+ * mm_mt_malloc - Allocate from the calling thread's tcache for small
+ *                requests, and from the locked heap otherwise
+ */
+void *mm_mt_malloc(size_t size) {
+    tcache_t *tc;
+    char *bp;
+
+    if (size == 0)
+        return NULL;
+
+    if (size <= MT_MAX && (tc = get_tcache()) != NULL) {
+        int cls = size_class(size);
+
+        if ((bp = tc->bins[cls]) == NULL && (bp = tcache_refill(tc, cls)) == NULL)
+            return NULL;
+        tc->bins[cls] = MT_LINK(bp);
+        tc->count[cls]--;
+        return bp;
+    }
+
+    if (size > SIZE_MAX - MT_HDR || (bp = heap_malloc(size + MT_HDR)) == NULL)
+        return NULL;
+    bp += MT_HDR;
+    MT_CLS(bp) = MT_LARGE;
+    MT_SIZE(bp) = size;
+    return bp;
+}
+
+/*
+ * mm_mt_free - Return a cached object to its tcache, or an uncached block
+ *              to the heap
+ */
+void mm_mt_free(void *bp) {
+    if (bp == NULL)
+        return;
+
+    unsigned cls = MT_CLS(bp);
+    if (cls == MT_LARGE) {
+        if (pthread_mutex_trylock(&heap_lock) != 0) {
+            remote_push(NULL, (char *)bp - MT_HDR);
+            if (pthread_mutex_trylock(&heap_lock) == 0)
+                heap_lock_release();
+            return;
+        }
+        mm_free((char *)bp - MT_HDR);
+        heap_lock_release();
+        return;
+    }
+
+    tcache_t *tc = &tcaches[MT_TCACHE(bp)];
+    if (tc != get_tcache()) {
+        remote_push(tc, bp);
+        return;
+    }
+    MT_LINK(bp) = tc->bins[cls];
+    tc->bins[cls] = bp;
+    if (++tc->count[cls] > MT_CACHE_MAX)
+        tcache_trim(tc, cls, MT_CACHE_MAX / 2);
+}
+
+/*
+ * mm_mt_realloc - Keep the object if its class does not change, resize
+ *                 uncached blocks in the heap, and move it otherwise
+ */
+void *mm_mt_realloc(void *ptr, size_t size) {
+    char *newptr;
+
+    if (size == 0) {
+        mm_mt_free(ptr);
+        return NULL;
+    }
+    if (ptr == NULL)
+        return mm_mt_malloc(size);
+
+    int cls = MT_CLS(ptr);
+    if (cls != MT_LARGE && size <= MT_MAX && size_class(size) == cls)
+        return ptr;
+
+    if (cls == MT_LARGE && size > MT_MAX) {
+        if (size > SIZE_MAX - MT_HDR)
+            return NULL;
+        heap_lock_acquire();
+        newptr = mm_realloc((char *)ptr - MT_HDR, size + MT_HDR);
+        heap_lock_release();
+        if (newptr == NULL)
+            return NULL;
+        newptr += MT_HDR;
+        MT_SIZE(newptr) = size;
+        return newptr;
+    }
+
+    if ((newptr = mm_mt_malloc(size)) == NULL)
+        return NULL;
+    size_t oldsize = cls == MT_LARGE ? MT_SIZE(ptr) : class_size(cls);
+    memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+    mm_mt_free(ptr);
+    return newptr;
+}
+
+/*
+ * mm_mt_calloc - Allocate zeroed memory for an array
+ */
+void *mm_mt_calloc(size_t nmemb, size_t size) {
+    void *ptr;
+
+    if (nmemb && size > SIZE_MAX / nmemb)
+        return NULL;
+    if ((ptr = mm_mt_malloc(nmemb * size)) != NULL)
+        memset(ptr, 0, nmemb * size);
+    return ptr;
+}
+
+/*
+ * The remaining routines are internal helper routines
+ */
+
+/*
+ * size_class - Cached class of a request for 1 to MT_MAX bytes
+ */
+static int size_class(size_t size) {
+    int lg;
+
+    if (size <= MT_SMALL)
+        return (size - 1) / MT_GRAIN;
+    lg = 63 - __builtin_clzl(size - 1);
+    return MT_SMALL / MT_GRAIN + (lg - MT_SMALL_SHIFT) * MT_SPLIT +
+           (((size - 1) >> (lg - MT_SPLIT_SHIFT)) & (MT_SPLIT - 1));
+}
+
+/*
+ * class_size - Payload size of the objects of class cls
+ */
+static size_t class_size(int cls) {
+    int step;
+
+    if (cls < MT_SMALL / MT_GRAIN)
+        return (size_t)(cls + 1) * MT_GRAIN;
+    cls -= MT_SMALL / MT_GRAIN;
+    step = cls / MT_SPLIT + MT_SMALL_SHIFT - MT_SPLIT_SHIFT;
+    return (size_t)(MT_SPLIT + cls % MT_SPLIT + 1) << step;
+}
+
+static void make_key(void) {
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/*
+ * get_tcache - Return the calling thread's tcache, adopting a free one
+ *              the first time the thread runs after mm_mt_init
+ */
+static tcache_t *get_tcache(void) {
+    if (my_gen == mt_gen)
+        return my_tcache;
+
+    my_gen = mt_gen;
+    my_tcache = NULL;
+    for (int i = 0; i < MT_TCACHES; i++) {
+        if (!__atomic_exchange_n(&tcaches[i].in_use, 1, __ATOMIC_ACQUIRE)) {
+            my_tcache = &tcaches[i];
+            my_tcache->gen = mt_gen;
+            pthread_setspecific(tcache_key, my_tcache);
+            break;
+        }
+    }
+    return my_tcache;
+}
+
+/*
+ * tcache_release - Thread exit hook: give the tcache's objects back to
+ *                  the heap and make the tcache available again. Tcaches
+ *                  of an earlier heap are left alone
+ */
+static void tcache_release(void *arg) {
+    tcache_t *tc = arg;
+
+    if (tc->gen != mt_gen || !tc->in_use)
+        return;
+    for (int cls = 0; cls < MT_CLASSES; cls++)
+        tcache_trim(tc, cls, 0);
+    __atomic_store_n(&tc->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * tcache_refill - Fill the empty list of class cls, first from the remote
+ *                 queue, then with a batch from the depot and last with a
+ *                 batch from the heap. Return the first cached object or
+ *                 NULL when out of memory
+ */
+static void *tcache_refill(tcache_t *tc, int cls) {
+    unsigned full = 0;
+    char *bp, *next;
+
+    bp = __atomic_exchange_n(&tc->remote, NULL, __ATOMIC_ACQUIRE);
+    for (; bp != NULL; bp = next) {
+        int c = MT_CLS(bp);
+        next = MT_LINK(bp);
+        MT_LINK(bp) = tc->bins[c];
+        tc->bins[c] = bp;
+        if (++tc->count[c] > MT_CACHE_MAX)
+            full |= 1U << c;
+    }
+    for (int c = 0; full; c++, full >>= 1)
+        if (full & 1)
+            tcache_trim(tc, c, MT_CACHE_MAX / 2);
+    if (tc->bins[cls] != NULL)
+        return tc->bins[cls];
+
+    if ((bp = depot_pop(cls)) != NULL) {
+        tc->bins[cls] = bp;
+        tc->count[cls] = MT_BATCH;
+        for (; bp != NULL; bp = MT_LINK(bp))
+            MT_TCACHE(bp) = tc - tcaches;
+        return tc->bins[cls];
+    }
+
+    heap_lock_acquire();
+    for (int i = 0; i < MT_BATCH; i++) {
+        if ((bp = mm_malloc(class_size(cls) + MT_HDR)) == NULL)
+            break;
+        bp += MT_HDR;
+        MT_CLS(bp) = cls;
+        MT_TCACHE(bp) = tc - tcaches;
+        MT_LINK(bp) = tc->bins[cls];
+        tc->bins[cls] = bp;
+        tc->count[cls]++;
+    }
+    heap_lock_release();
+    return tc->bins[cls];
+}
+
+/*
+ * tcache_trim - Move cached objects of class cls to its depot in
+ *               batches, and free the rest, until keep are left
+ */
+static void tcache_trim(tcache_t *tc, int cls, unsigned keep) {
+    char *bp;
+
+    while (tc->count[cls] >= keep + MT_BATCH) {
+        char *batch = tc->bins[cls], *last = batch;
+        for (int i = 1; i < MT_BATCH; i++)
+            last = MT_LINK(last);
+        tc->bins[cls] = MT_LINK(last);
+        MT_LINK(last) = NULL;
+        if (depot_push(cls, batch) < 0) {
+            MT_LINK(last) = tc->bins[cls];
+            tc->bins[cls] = batch;
+            break;
+        }
+        tc->count[cls] -= MT_BATCH;
+    }
+    if (tc->count[cls] <= keep)
+        return;
+
+    heap_lock_acquire();
+    while (tc->count[cls] > keep) {
+        bp = tc->bins[cls];
+        tc->bins[cls] = MT_LINK(bp);
+        tc->count[cls]--;
+        mm_free(bp - MT_HDR);
+    }
+    heap_lock_release();
+}
+
+/*
+ * remote_push - Hand an object back to its owning tcache, or an uncached
+ *               block to the deferred list if tc is NULL
+ */
+static void remote_push(tcache_t *tc, void *bp) {
+    void **list = tc ? &tc->remote : &deferred;
+    void *head = __atomic_load_n(list, __ATOMIC_RELAXED);
+
+    do {
+        MT_LINK(bp) = head;
+    } while (!__atomic_compare_exchange_n(list, &head, bp, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * depot_push - Put a batch of MT_BATCH objects on the depot of class cls.
+ *              Return 0 on success and -1 if the depot is full
+ */
+static int depot_push(int cls, char *batch) {
+    depot_t *d = &depots[cls];
+    uint64_t head, top;
+
+    if (__atomic_load_n(&d->batches, __ATOMIC_RELAXED) >= MT_DEPOT_MAX)
+        return -1;
+    head = __atomic_load_n(&d->head, __ATOMIC_RELAXED);
+    do {
+        MT_NEXT_BATCH(batch) = DEPOT_PTR(head);
+        top = DEPOT_HEAD((head >> 32) + 1, batch);
+    } while (!__atomic_compare_exchange_n(&d->head, &head, top, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&d->batches, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * depot_pop - Take the top batch off the depot of class cls, or return
+ *             NULL if it is empty. The second word of a batch popped by
+ *             someone else may be stale by the time it is read, but then
+ *             the tag has moved on and the swap fails
+ */
+static char *depot_pop(int cls) {
+    depot_t *d = &depots[cls];
+    uint64_t head, top;
+    char *batch;
+
+    head = __atomic_load_n(&d->head, __ATOMIC_ACQUIRE);
+    do {
+        if ((batch = DEPOT_PTR(head)) == NULL)
+            return NULL;
+        top = DEPOT_HEAD((head >> 32) + 1,
+                         __atomic_load_n(&MT_NEXT_BATCH(batch), __ATOMIC_RELAXED));
+    } while (!__atomic_compare_exchange_n(&d->head, &head, top, 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    __atomic_sub_fetch(&d->batches, 1, __ATOMIC_RELAXED);
+    return batch;
+}
+
+/*
+ * heap_lock_acquire - Take heap_lock and free the deferred blocks
+ */
+static void heap_lock_acquire(void) {
+    pthread_mutex_lock(&heap_lock);
+    free_deferred();
+}
+
+/*
+ * heap_lock_release - Free the deferred blocks and release heap_lock.
+ *                     Blocks deferred meanwhile are freed by taking the
+ *                     lock again, unless someone else holds it by then
+ */
+static void heap_lock_release(void) {
+    do {
+        free_deferred();
+        pthread_mutex_unlock(&heap_lock);
+    } while (__atomic_load_n(&deferred, __ATOMIC_SEQ_CST) != NULL &&
+             pthread_mutex_trylock(&heap_lock) == 0);
+}
+
+/*
+ * free_deferred - Free the deferred blocks, with heap_lock held
+ */
+static void free_deferred(void) {
+    char *bp, *next;
+
+    if (__atomic_load_n(&deferred, __ATOMIC_RELAXED) == NULL)
+        return;
+    bp = __atomic_exchange_n(&deferred, NULL, __ATOMIC_ACQUIRE);
+    for (; bp != NULL; bp = next) {
+        next = MT_LINK(bp);
+        mm_free(bp);
+    }
+}
+
+/*
+ * heap_malloc - mm_malloc with the heap lock held
+ */
+static void *heap_malloc(size_t size) {
+    void *bp;
+
+    heap_lock_acquire();
+    bp = mm_malloc(size);
+    heap_lock_release();
+    return bp;
+}
@@ -0,0 +1,220 @@
+/*
+ * mm-region.c - Region allocator on top of the allocator in mm.c.
+ *
+ * A region hands out memory by bumping a pointer through chunks it gets
+ * from mm_malloc, so regions share the heap with ordinary blocks. Its
+ * objects are never freed one by one: they all die together when the
+ * region is reset or destroyed, or when a scope opened with
+ * mm_region_mark is closed with mm_region_release.
+ *
+ * The chunks of a region, all REGION_CHUNK bytes, form a list, oldest
+ * first, which starts with the chunk holding the region itself. A mark
+ * remembers the last chunk of the list as well as the bump pointer, and
+ * closing a scope cuts off every chunk appended since. Chunks cut off
+ * that way go to a list of spare chunks shared by all regions, in one
+ * step, and new chunks come from there first. Since every spare chunk
+ * has the same size, any of them will do.
+ *
+ * Requests of more than REGION_LARGE bytes get a chunk of their own,
+ * which goes on a second list of the region, newest first. Such chunks
+ * differ in size, so closing a scope gives them straight back to mm.c.
+ * Releasing, resetting and destroying thus take constant time plus one
+ * mm_free per large request. mm_region_trim gives the spare chunks back
+ * to mm.c, and mm_init forgets them along with the old heap.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "mm.h"
+
+#define REGION_CHUNK    (1 << 14)   /* default chunk size, with header */
+#define REGION_LARGE    (REGION_CHUNK / 4)
+#define REGION_ALIGN    8
+
+/* rounds up to the nearest multiple of REGION_ALIGN */
+#define REGION_ROUND(size)  (((size) + (REGION_ALIGN-1)) & ~(size_t)(REGION_ALIGN-1))
+
+typedef struct mm_chunk {
+    struct mm_chunk *next;      /* next younger, spare or older large chunk */
+    char *end;                  /* end of the chunk */
+} chunk_t;
+
+#define CHUNK_HDR       REGION_ROUND(sizeof(chunk_t))
+#define CHUNK_START(c)  ((char *)(c) + CHUNK_HDR)
+
+struct mm_region {
+    chunk_t *tail;              /* youngest chunk */
+    chunk_t *cur;               /* chunk being bumped */
+    chunk_t *large;             /* youngest chunk of a large request */
+    char *ptr, *end;            /* free space in cur */
+    mm_region_mark_t base;      /* state right after mm_region_create */
+};
+
+/* Global variables */
+static chunk_t *spare;          /* chunks no region uses */
+
+/* Function prototypes for internal helper routines */
+static chunk_t *chunk_get(void);
+static void chunk_spare(chunk_t *first, chunk_t *last);
+static void chunk_free_large(chunk_t *c, chunk_t *stop);
+
+/*
+ * mm_region_create - Create an empty region. Return NULL when out of
+ *                    memory
+ */
+mm_region_t *mm_region_create(void) {
+    chunk_t *c = chunk_get();
+    mm_region_t *r;
+
+    if (c == NULL)
+        return NULL;
+    r = (mm_region_t *)CHUNK_START(c);
+    r->tail = r->cur = c;
+    r->large = NULL;
+    r->ptr = CHUNK_START(c) + REGION_ROUND(sizeof(mm_region_t));
+    r->end = c->end;
+    r->base = mm_region_mark(r);
+    return r;
+}
+
+/*
+ * mm_region_alloc - Allocate size bytes, aligned to 8 bytes, from region
+ *                   r. Return NULL when out of memory
+ */
+void *mm_region_alloc(mm_region_t *r, size_t size) {
+    char *bp;
+    chunk_t *c;
+
+    if (size > SIZE_MAX - CHUNK_HDR - REGION_ALIGN)
+        return NULL;
+    size = REGION_ROUND(size);
+    if (size <= (size_t)(r->end - r->ptr)) {
+        bp = r->ptr;
+        r->ptr += size;
+        return bp;
+    }
+
+    if (size > REGION_LARGE) {
+        if ((c = mm_malloc(CHUNK_HDR + size)) == NULL)
+            return NULL;
+        c->end = CHUNK_START(c) + size;
+        c->next = r->large;
+        r->large = c;
+        return CHUNK_START(c);
+    }
+
+    if ((c = chunk_get()) == NULL)
+        return NULL;
+    r->tail->next = c;
+    r->tail = c;
+    r->cur = c;
+    r->ptr = CHUNK_START(c) + size;
+    r->end = c->end;
+    return CHUNK_START(c);
+}
+
+/*
+ * mm_region_mark - Open a scope: remember how far region r is allocated
+ */
+mm_region_mark_t mm_region_mark(mm_region_t *r) {
+    mm_region_mark_t m = { r->tail, r->cur, r->large, r->ptr };
+    return m;
+}
+
+/*
+ * mm_region_release - Close the scope opened by mark m, freeing all that
+ *                     region r allocated since. Scopes opened after m
+ *                     are closed with it
+ */
+void mm_region_release(mm_region_t *r, mm_region_mark_t m) {
+    chunk_t *tail = m.tail;
+
+    chunk_free_large(r->large, m.large);
+    r->large = m.large;
+    if (tail != r->tail) {
+        chunk_spare(tail->next, r->tail);
+        tail->next = NULL;
+        r->tail = tail;
+    }
+    r->cur = m.cur;
+    r->ptr = m.ptr;
+    r->end = m.cur->end;
+}
+
+/*
+ * mm_region_reset - Free everything allocated from region r
+ */
+void mm_region_reset(mm_region_t *r) {
+    mm_region_release(r, r->base);
+}
+
+/*
+ * mm_region_destroy - Free region r with everything allocated from it
+ */
+void mm_region_destroy(mm_region_t *r) {
+    chunk_free_large(r->large, NULL);
+    chunk_spare(r->base.tail, r->tail);
+}
+
+/*
+ * mm_region_trim - Give all spare chunks back to mm.c
+ */
+void mm_region_trim(void) {
+    chunk_t *c;
+
+    while ((c = spare) != NULL) {
+        spare = c->next;
+        mm_free(c);
+    }
+}
+
+/*
+ * mm_region_heap_init - Forget the spare chunks, called by mm_init since
+ *                       they went away with the old heap
+ */
+void mm_region_heap_init(void) {
+    spare = NULL;
+}
+
+/*
+ * The remaining routines are internal helper routines
+ */
+
+/*
+ * chunk_get - A chunk of REGION_CHUNK bytes, header included, from the
+ *             spare list or from mm.c
+ */
+static chunk_t *chunk_get(void) {
+    chunk_t *c = spare;
+
+    if (c != NULL)
+        spare = c->next;
+    else if ((c = mm_malloc(REGION_CHUNK)) != NULL)
+        c->end = (char *)c + REGION_CHUNK;
+    else
+        return NULL;
+    c->next = NULL;
+    return c;
+}
+
+/*
+ * chunk_spare - Put the chunks from first to last on the spare list
+ */
+static void chunk_spare(chunk_t *first, chunk_t *last) {
+    last->next = spare;
+    spare = first;
+}
+
+/*
+ * chunk_free_large - Give the large chunks from c up to stop back to mm.c
+ */
+static void chunk_free_large(chunk_t *c, chunk_t *stop) {
+    chunk_t *next;
+
+    for (; c != stop; c = next) {
+        next = c->next;
+        mm_free(c);
+    }
+}
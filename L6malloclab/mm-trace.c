@@ -0,0 +1,339 @@
+/*
+ * mm-trace.c - Trace recorder for the allocator in mm.c.
+ *
+ * Between mm_trace_start and mm_trace_stop, mm.c reports every malloc,
+ * realloc, free and aligned allocation here, and they are written to a
+ * trace in mdriver's format: weight, number of ids, number of ops and
+ * ignore-ranges, then one "a id size", "r id size", "m id size align" or
+ * "f id" line per request. Replay it with mdriver -f.
+ *
+ * Every allocation gets the next id, and a realloc keeps the id of its
+ * block. Blocks are mapped to their ids in an open addressing hash table
+ * that lives in its own mmap region, since the recorder must not call
+ * malloc. Frees of blocks allocated before recording started are left
+ * out, and a realloc of such a block is recorded as one of a new id,
+ * which mdriver replays as a malloc.
+ *
+ * Records are formatted by hand into TRACE_BUF bytes and written out in
+ * batches. The header counts are unknown until the end, so a padded
+ * header is written first and overwritten by mm_trace_stop.
+ *
+ * The recorder also counts allocations and their bytes per size class
+ * of mm.c, for mm_trace_hist.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+
+#define TRACE_BUF       (1 << 16)   /* bytes of records written at once */
+#define TRACE_LINE      64          /* longest record */
+#define TRACE_SLOTS     (1 << 12)   /* initial size of the id table */
+#define TRACE_HEADER    "%1d\n%10d\n%10d\n%1d\n"
+
+/* Home slot of block ptr bp in a table of n slots */
+#define TRACE_HASH(bp, n) \
+    ((size_t)((((size_t)(bp) >> 3) * 0x9E3779B97F4A7C15ULL) >> 32) & ((n) - 1))
+
+typedef struct {
+    void *bp;                   /* block, NULL if the slot is empty */
+    int id;
+} slot_t;
+
+/* Global variables */
+int mm_trace_on;                        /* recording right now */
+static int fd = -1;                     /* trace file */
+static char buf[TRACE_BUF];             /* records not written yet */
+static size_t len;                      /* bytes in buf */
+static int ids, ops;                    /* header counts */
+static slot_t *slots;                   /* id table */
+static size_t num_slots, used;          /* table size and entries */
+static unsigned long allocs[MM_INFO_CLASSES];   /* histogram */
+static size_t bytes[MM_INFO_CLASSES];
+
+/* Function prototypes for internal helper routines */
+static void stop_exit(void);
+static void record(char op, int id, size_t size, size_t align);
+static void flush(void);
+static char *put_num(char *p, size_t n);
+static int lookup(void *bp);
+static void insert(void *bp, int id);
+static void delete(void *bp);
+static int grow(void);
+static void count(size_t size);
+
+/*
+ * mm_trace_start - Record all requests to mm.c into a new trace at path.
+ *                  The trace is finished at exit if mm_trace_stop is not
+ *                  called first. Return 0 on success and -1 on error
+ */
+int mm_trace_start(const char *path) {
+    static int registered;
+    char header[64];
+    int n;
+
+    if (fd >= 0)
+        mm_trace_stop();
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+    n = snprintf(header, sizeof(header), TRACE_HEADER, 1, 0, 0, 0);
+    if (write(fd, header, n) != n) {
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    if (slots == NULL && grow() < 0) {
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+    memset(slots, 0, num_slots * sizeof(slot_t));
+    memset(allocs, 0, sizeof(allocs));
+    memset(bytes, 0, sizeof(bytes));
+    used = len = 0;
+    ids = ops = 0;
+    if (!registered) {
+        atexit(stop_exit);
+        registered = 1;
+    }
+    mm_trace_on = 1;
+    return 0;
+}
+
+/*
+ * mm_trace_stop - Write out the rest of the trace and its header. Return
+ *                 0 on success and -1 if not recording or on error
+ */
+int mm_trace_stop(void) {
+    char header[64];
+    int n, err = 0;
+
+    if (fd < 0)
+        return -1;
+    mm_trace_on = 0;
+    flush();
+    n = snprintf(header, sizeof(header), TRACE_HEADER, 1, ids, ops, 0);
+    if (len || pwrite(fd, header, n, 0) != n)
+        err = -1;
+    close(fd);
+    fd = -1;
+    return err;
+}
+
+/*
+ * mm_trace_alloc - Record a new block bp of size bytes, aligned to align
+ *                  bytes if align is not 0
+ */
+void mm_trace_alloc(void *bp, size_t size, size_t align) {
+    if (lookup(bp) >= 0)            /* missed its free, e.g. on a heap reset */
+        delete(bp);
+    insert(bp, ids);
+    count(size);
+    record(align ? 'm' : 'a', ids++, size, align);
+}
+
+/*
+ * mm_trace_realloc - Record that realloc(old, size) returned bp
+ */
+void mm_trace_realloc(void *old, void *bp, size_t size) {
+    int id = old ? lookup(old) : -1;
+
+    if (size == 0) {
+        if (id >= 0) {
+            delete(old);
+            record('f', id, 0, 0);
+        }
+        return;
+    }
+    if (bp == NULL)                 /* failed, old is still there */
+        return;
+    if (id >= 0)
+        delete(old);
+    else
+        id = ids++;
+    if (lookup(bp) >= 0)
+        delete(bp);
+    insert(bp, id);
+    count(size);
+    record('r', id, size, 0);
+}
+
+/*
+ * mm_trace_free - Record that block bp was freed
+ */
+void mm_trace_free(void *bp) {
+    int id = lookup(bp);
+
+    if (id >= 0) {
+        delete(bp);
+        record('f', id, 0, 0);
+    }
+}
+
+/*
+ * mm_trace_hist - Copy the allocations and their bytes per size class
+ *                 recorded since mm_trace_start. Classes are numbered as
+ *                 in mm_info_t
+ */
+void mm_trace_hist(unsigned long *class_allocs, size_t *class_bytes) {
+    memcpy(class_allocs, allocs, sizeof(allocs));
+    memcpy(class_bytes, bytes, sizeof(bytes));
+}
+
+/*
+ * The remaining routines are internal helper routines
+ */
+
+static void stop_exit(void) {
+    mm_trace_stop();
+}
+
+/*
+ * record - Append one request to the trace
+ */
+static void record(char op, int id, size_t size, size_t align) {
+    char *p;
+
+    if (len > TRACE_BUF - TRACE_LINE) {
+        flush();
+        if (len > TRACE_BUF - TRACE_LINE) {     /* cannot write, give up */
+            mm_trace_on = 0;
+            return;
+        }
+    }
+    p = buf + len;
+    *p++ = op;
+    *p++ = ' ';
+    p = put_num(p, id);
+    if (op != 'f') {
+        *p++ = ' ';
+        p = put_num(p, size);
+    }
+    if (op == 'm') {
+        *p++ = ' ';
+        p = put_num(p, align);
+    }
+    *p++ = '\n';
+    len = p - buf;
+    ops++;
+}
+
+/*
+ * flush - Write out the buffered records. Keep them on error
+ */
+static void flush(void) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len && (n = write(fd, buf + done, len - done)) > 0)
+        done += n;
+    memmove(buf, buf + done, len - done);
+    len -= done;
+}
+
+/*
+ * put_num - Write n in decimal at p and return the end
+ */
+static char *put_num(char *p, size_t n) {
+    char digits[24];
+    int i = 0;
+
+    do {
+        digits[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (i > 0)
+        *p++ = digits[--i];
+    return p;
+}
+
+/*
+ * lookup - Id of block bp, or -1 if it is not in the table
+ */
+static int lookup(void *bp) {
+    size_t i;
+
+    for (i = TRACE_HASH(bp, num_slots); slots[i].bp; i = (i + 1) & (num_slots - 1))
+        if (slots[i].bp == bp)
+            return slots[i].id;
+    return -1;
+}
+
+/*
+ * insert - Add block bp with id to the table, which must not hold it.
+ *          Stop recording if the table cannot grow
+ */
+static void insert(void *bp, int id) {
+    size_t i;
+
+    if (2 * (used + 1) > num_slots && grow() < 0) {
+        mm_trace_on = 0;
+        return;
+    }
+    for (i = TRACE_HASH(bp, num_slots); slots[i].bp; i = (i + 1) & (num_slots - 1))
+        ;
+    slots[i].bp = bp;
+    slots[i].id = id;
+    used++;
+}
+
+/*
+ * delete - Remove block bp from the table, moving later entries of its
+ *          probe sequence back so that no lookup stops short
+ */
+static void delete(void *bp) {
+    size_t mask = num_slots - 1;
+    size_t i, j, home;
+
+    for (i = TRACE_HASH(bp, num_slots); slots[i].bp != bp; i = (i + 1) & mask)
+        if (slots[i].bp == NULL)
+            return;
+    for (j = (i + 1) & mask; slots[j].bp; j = (j + 1) & mask) {
+        home = TRACE_HASH(slots[j].bp, num_slots);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i].bp = NULL;
+    used--;
+}
+
+/*
+ * grow - Double the id table, or map its first TRACE_SLOTS slots. Return
+ *        0 on success and -1 when out of memory
+ */
+static int grow(void) {
+    size_t old = num_slots, n = old ? 2 * old : TRACE_SLOTS;
+    slot_t *s = mmap(NULL, n * sizeof(slot_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    slot_t *prev = slots;
+    size_t i;
+
+    if (s == MAP_FAILED)
+        return -1;
+    slots = s;
+    num_slots = n;
+    used = 0;
+    for (i = 0; i < old; i++)
+        if (prev[i].bp)
+            insert(prev[i].bp, prev[i].id);
+    if (prev)
+        munmap(prev, old * sizeof(slot_t));
+    return 0;
+}
+
+/*
+ * count - Add an allocation of size bytes to the histogram
+ */
+static void count(size_t size) {
+    int c = mm_size_class(size);
+
+    allocs[c]++;
+    bytes[c] += size;
+}
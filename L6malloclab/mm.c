@@ -1,15 +1,69 @@
 /* 
- * Simple, 32-bit and 64-bit clean allocator based on implicit free
- * lists, first-fit placement, and boundary tag coalescing, as described
- * in the CS:APP3e text. Blocks must be aligned to doubleword (8 byte) 
- * boundaries. Minimum block size is 16 bytes. 
+ * Simple, 32-bit and 64-bit clean allocator based on segregated explicit
+ * free lists, first-fit placement, and boundary tag coalescing, as described
+ * in the CS:APP3e text. Free blocks are kept in doubly linked lists of
+ * 32-bit heap offsets so that they can be unlinked in constant time.
+ * Free blocks of LARGE_LIMIT bytes or more form a splay tree instead, which
+ * gives best fit for large requests in logarithmic amortized time.
+ * Allocated blocks carry only a header. Blocks must be aligned to
+ * doubleword (8 byte) boundaries. Minimum block size is 8 bytes: such
+ * mini blocks have no footer, and when free they are on no list. They are
+ * slack that coalescing picks up once a neighbour is freed.
+ *
+ * Unless built with -DSLAB_ALLOC=0, requests of up to SLAB_MAX bytes are served
+ * from per-size-class slabs instead: SLAB_SIZE aligned allocated blocks
+ * carved at the end of the heap and cut into headerless objects.
+ *
+ * Requests of at least MMAP_THRESHOLD bytes bypass the heap and get a
+ * region of their own from mem_map, which is unmapped again on free.
+ *
+ * Freeing gives memory back: once the last block of the heap has been free
+ * and at least TRIM_THRESHOLD bytes large for TRIM_FREES frees in a row, it
+ * is cut down to TRIM_KEEP bytes by shrinking the heap. Every RELEASE_DIRTY
+ * bytes freed into other free blocks of at least RELEASE_THRESHOLD bytes,
+ * the whole pages inside those of them that stayed untouched since the
+ * previous such purge are released with mem_release.
+ *
+ * With mm_mallopt(MM_DEFER_COALESCE, 1), freed blocks of up to QUICK_MAX
+ * bytes are parked on quick lists instead and coalesced in batches.
+ *
+ * memalign, posix_memalign and aligned_alloc carve the aligned block out
+ * of a free block and free the slack in front of it again.
+ *
+ * mm_checkheap walks the whole heap. For continuous checking under load,
+ * mm_mallopt(MM_CHECK_SLICE, n) makes every malloc, free and realloc check
+ * the next n blocks after a rotating cursor and one more list head, and
+ * mm_mallopt(MM_CHECK_FULL, n) runs mm_checkheap on every n-th call.
+ *
+ * mm_mallopt(MM_PROFILE, n) samples about one allocation per n bytes for
+ * the heap profiler in mm-prof.c. malloc only counts the bytes down until
+ * the next sample is due, and free looks the block up only while samples
+ * are live.
+ *
+ * mm_trace_start makes malloc, realloc, free and memalign report to the
+ * trace recorder in mm-trace.c. realloc is recorded as one request, so the
+ * recorder is off while it runs.
+ *
+ * The region allocator in mm-region.c carves its chunks out of malloc
+ * and keeps spare ones between regions. mm_init tells it to drop them.
+ *
+ * Hardening, all off by default. With -DHARDEN_CANARY every heap block
+ * ends in a canary word right in front of the next header, checked when
+ * the block is freed or resized and by mm_checkheap. -DHARDEN_JUNK=n fills
+ * the first n bytes of freed heap blocks and slab objects with a random
+ * byte. -DHARDEN_GUARD puts mapped blocks right in front of an inaccessible
+ * guard page. make bench-harden measures what each of them costs.
  */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /* do not change the following! */
 #ifdef DRIVER
@@ -18,6 +72,9 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #endif /* def DRIVER */
 
 // #define DEBUG // uncomment this line to enable debugging
@@ -41,13 +98,41 @@
 
 #define WSIZE       4                   /* Word and header/footer size (bytes) */ 
 #define DSIZE       8                   /* Double word size (bytes) */
+
+/* Heap geometry, tunable with -D, see tune.sh. Blocks of MINSIZE bytes are
+ * the footerless mini blocks, with 4 bytes of payload at 8 and 12 at 16 */
+#ifndef CHUNKSIZE
 #define CHUNKSIZE   ((1<<12))   /* Extend heap by this amount (bytes) */  
-#define MINSIZE     16                  /* Minimum size of a block */
+#endif
+#ifndef MINSIZE
+#define MINSIZE     8                   /* Minimum size of a block */
+#endif
+#if MINSIZE != 8 && MINSIZE != 16
+#error "MINSIZE must be 8 or 16"
+#endif
+
+/* Adaptive heap growth. When no block fits, malloc extends the heap by
+ * growSize bytes, less whatever the free last block already covers. It
+ * doubles, up to GROW_MAX, when the heap runs out again within GROW_BURST
+ * fits, and halves for every GROW_IDLE fits without running out. Past
+ * CHUNKSIZE it never exceeds 1/GROW_SHARE of the heap, so that a small
+ * heap is not left with a mostly unused chunk at its peak */
+#ifndef GROW_MAX
+#define GROW_MAX    (CHUNKSIZE << 2)
+#endif
+#define GROW_BURST  64
+#define GROW_IDLE   4096
+#define GROW_SHARE  8
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))  
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
-/* Pack a size and allocated bit into a word */
-#define PACK(size, prev_alloc, alloc)  ((size) | ((prev_alloc) << 1) |(alloc)) 
+/* Pack a size, the status bits of the previous block and an allocated bit
+ * into a word */
+#define PACK(size, prev, alloc)  ((size) | (prev) | (alloc)) 
+#define PREV_ALLOC  0x2     /* previous block is allocated */
+#define PREV_MINI   0x4     /* previous block is a mini block (no footer) */
+#define MINI_BIT(size)  ((size) == MINSIZE ? PREV_MINI : 0)
 
 /* Read and write a word at address p */
 #define GET(p)       (*(unsigned *)(p))            
@@ -56,37 +141,331 @@
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p)                 (GET(p) & ~0x7)                   
 #define GET_ALLOC(p)                (GET(p) & 0x1)
-#define GET_PREV_ALLOC(p)           ((GET(p) & 0x2) >> 1)   
-#define SET_PREV_ALLOC(p, alloc)    (PUT(p, PACK(GET_SIZE(p), alloc, GET_ALLOC(p))))         
+#define GET_PREV(p)                 (GET(p) & (PREV_ALLOC | PREV_MINI))
+#define GET_PREV_ALLOC(p)           ((GET(p) & PREV_ALLOC) >> 1)   
+#define GET_PREV_MINI(p)            ((GET(p) & PREV_MINI) >> 2)   
+#define SET_PREV_ALLOC(p, alloc)    (PUT(p, (GET(p) & ~PREV_ALLOC) | ((alloc) << 1)))         
+#define SET_PREV_INFO(p, prev)      (PUT(p, (GET(p) & ~(PREV_ALLOC | PREV_MINI)) | (prev)))         
 
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp)       ((char *)(bp) - WSIZE)                      
 #define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE) 
 
-/* Given non-free block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and previous blocks. 
+ * PREV_BLKP is only valid when the previous block is free */
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE))) 
-#define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE))) 
+#define PREV_BLKP(bp)  ((char *)(bp) - (GET_PREV_MINI(HDRP(bp)) ? MINSIZE : \
+                                        GET_SIZE(((char *)(bp) - DSIZE)))) 
+
+/* Free list links are 32-bit offsets from link_base, which sits one word
+ * below the heap so that no list head or block has offset 0 (NULL). The
+ * simulated heap is bounded by MAX_HEAP, far below 4GB */
+#define TO_OFF(p)       ((p) ? (unsigned)((char *)(p) - link_base) : 0)
+#define TO_PTR(off)     ((off) ? (void *)(link_base + (off)) : NULL)
+
+/* Given free block ptr bp, get pointers of next and previous free blocks.
+ * A list head only has a next field, so PREV of the first block points
+ * at the list head itself */
+#define NEXT(bp)            TO_PTR(GET(bp))
+#define SET_NEXT(bp, next)  PUT(bp, TO_OFF(next))
+#define PREV(bp)            TO_PTR(GET((char *)(bp) + WSIZE))
+#define SET_PREV(bp, prev)  PUT((char *)(bp) + WSIZE, TO_OFF(prev))
+
+/* Size classes. Blocks below SMALL_LIMIT get one exact class per multiple
+ * of 8. Above it each power of two [2^fl, 2^(fl+1)) is split into SL_COUNT
+ * equal sub-classes, and everything from LARGE_LIMIT up shares the final
+ * class */
+#define SMALL_LOG       7
+#define SMALL_LIMIT     (1 << SMALL_LOG)
+#define SMALL_CLASSES   (SMALL_LIMIT / ALIGNMENT)
+#ifndef SL_BITS
+#define SL_BITS         2
+#endif
+#define SL_COUNT        (1 << SL_BITS)
+#ifndef LARGE_LOG
+#define LARGE_LOG       15
+#endif
+#define LARGE_LIMIT     (1 << LARGE_LOG)
+#define FREELIST_COUNT  (SMALL_CLASSES + (LARGE_LOG - SMALL_LOG) * SL_COUNT + 1)
+#if FREELIST_COUNT > 64 || SL_BITS > SMALL_LOG - 3 || LARGE_LOG <= SMALL_LOG
+#error "freeMap holds at most 64 classes, each at least 8 bytes wide"
+#endif
+#define FREELIST_BYTES  ALIGN(FREELIST_COUNT*WSIZE)
+#define TREE_CLASS      (FREELIST_COUNT-1)
+
+/* The final class is a splay tree ordered by size and then address, whose
+ * root is kept in the class's list head. A node stores its children where
+ * list blocks store their next and prev links */
+#define TREE_ROOT           TO_PTR(GET(freeLists + TREE_CLASS*WSIZE))
+#define SET_ROOT(bp)        PUT(freeLists + TREE_CLASS*WSIZE, TO_OFF(bp))
+#define LEFT(bp)            TO_PTR(GET(bp))
+#define SET_LEFT(bp, l)     PUT(bp, TO_OFF(l))
+#define RIGHT(bp)           TO_PTR(GET((char *)(bp) + WSIZE))
+#define SET_RIGHT(bp, r)    PUT((char *)(bp) + WSIZE, TO_OFF(r))
+
+/* Is the key (size, addr) ordered before tree node bp, or after it */
+#define KEY_BEFORE(size, addr, bp)  ((size) < GET_SIZE(HDRP(bp)) || \
+    ((size) == GET_SIZE(HDRP(bp)) && (char *)(addr) < (char *)(bp)))
+#define KEY_AFTER(size, addr, bp)   ((size) > GET_SIZE(HDRP(bp)) || \
+    ((size) == GET_SIZE(HDRP(bp)) && (char *)(addr) > (char *)(bp)))
+
+/* Placement policies for find_fit. Select one at compile time with
+ * -DFIT_POLICY=<policy>, e.g. make MMFLAGS=-DFIT_POLICY=BEST_FIT */
+#define FIRST_FIT   0   /* first block that fits */
+#define GOOD_FIT    1   /* best of the first FIT_CANDIDATES blocks that fit */
+#define BEST_FIT    2   /* smallest block that fits */
+
+#ifndef FIT_POLICY
+#define FIT_POLICY      GOOD_FIT
+#endif
+#ifndef FIT_CANDIDATES
+#define FIT_CANDIDATES  8
+#endif
+
+/* Slab sub-allocator for small requests, disable with -DSLAB_ALLOC=0.
+ * A slab is an allocated block of SLAB_SIZE bytes whose payload starts on
+ * a SLAB_SIZE boundary. It begins with a
+ * SLAB_HDR byte header and holds objects of one class, (cls+1)*8 bytes
+ * each, with no per-object header. slabMap has one bit per SLAB_SIZE
+ * page of the heap that is set iff the page holds a slab, which is how
+ * free() tells slab objects from blocks. A class gets its first slab
+ * after SLAB_WARMUP requests; until then they are served by ordinary
+ * blocks, so that a few small requests do not pin mostly empty slabs */
+#ifndef SLAB_ALLOC
+#define SLAB_ALLOC      1
+#endif
+#ifndef SLAB_SHIFT
+#define SLAB_SHIFT      10
+#endif
+#define SLAB_SIZE       (1 << SLAB_SHIFT)
+#define SLAB_MAX        64
+#define SLAB_CLASSES    (SLAB_MAX / ALIGNMENT)
+#define SLAB_HDR        24
+#ifndef SLAB_WARMUP
+#define SLAB_WARMUP     128
+#endif
+
+#if SLAB_ALLOC
+#define SLAB_BYTES      ALIGN(SLAB_CLASSES*WSIZE)
+#else
+#define SLAB_BYTES      0
+#endif
+
+/* Slab header fields. FREE, BUMP and free objects' links are offsets
+ * from the slab start; NEXT and PREV link partial slabs of a class like
+ * free blocks, with the list head in the heap prologue */
+#define SLAB_CLASS(s)   ((char *)(s))           /* size class */
+#define SLAB_USED(s)    ((char *)(s) + 4)       /* objects handed out */
+#define SLAB_FREE(s)    ((char *)(s) + 8)       /* first freed object */
+#define SLAB_BUMP(s)    ((char *)(s) + 12)      /* first never used object */
+#define SLAB_NEXT(s)    ((char *)(s) + 16)
+#define SLAB_PREV(s)    ((char *)(s) + 20)
+
+#define SLAB_OBJ(cls)   ((size_t)((cls) + 1) * ALIGNMENT)
+#define SLAB_CAP(cls)   ((unsigned)((SLAB_SIZE - WSIZE - SLAB_HDR) / SLAB_OBJ(cls)))
+
+/* Mapped blocks for huge requests, disable with -DMMAP_THRESHOLD=0. A
+ * region starts with a MAP_HDR byte header holding its size and the links
+ * of the list of mapped blocks, followed by the payload. Any payload
+ * outside the heap belongs to a mapped block. With HARDEN_GUARD the region
+ * ends in a guard page, and the payload ends right in front of it, so the
+ * header may sit anywhere in the first page of the region */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD  (1<<16)
+#endif
+#define MAP_HDR         24
+#define MAP_SIZE(bp)    (*(size_t *)((char *)(bp) - MAP_HDR))
+#define MAP_NEXT(bp)    (*(char **)((char *)(bp) - 2*DSIZE))
+#define MAP_PREV(bp)    (*(char **)((char *)(bp) - DSIZE))
+#define MAP_BASE(bp)    ((char *)((size_t)((char *)(bp) - MAP_HDR) & ~(mem_pagesize() - 1)))
+#define MAP_GUARD       (HARDEN_GUARD ? mem_pagesize() : 0)
+#define IS_MAPPED(bp)   ((char *)(bp) < heap_listp || (char *)(bp) >= epilogue)
+
+/* Returning memory on free, disable either with a threshold of 0. A large
+ * free block carries a purge mark after its links: 0 if it changed since
+ * the last purge, the number of that purge, or PURGE_DONE once released */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD      (1<<20)
+#endif
+#ifndef TRIM_FREES
+#define TRIM_FREES          64
+#endif
+#ifndef TRIM_KEEP
+#define TRIM_KEEP           (TRIM_THRESHOLD/4)
+#endif
+#ifndef RELEASE_THRESHOLD
+#define RELEASE_THRESHOLD   (1<<16)
+#endif
+#ifndef RELEASE_DIRTY
+#define RELEASE_DIRTY       (1<<22)
+#endif
+#define PURGE_MARK(bp)      ((char *)(bp) + DSIZE)
+#define PURGE_DONE          1
+
+/* Deferred coalescing. A parked block stays marked allocated, so that its
+ * neighbours do not merge with it, and sits on the quick list of its
+ * exact size, linked like a mini free block. malloc reuses it without
+ * splitting. All parked blocks are freed for real, in one batch, when no
+ * fit is found or QUICK_LIMIT bytes are parked */
+#define QUICK_MAX       256
+#define QUICK_COUNT     (QUICK_MAX / ALIGNMENT + 1)
+#define QUICK_LIMIT     (1<<16)
+
+/* Hardening, see the top of the file. A canary is a word derived from
+ * the block address and canarySecret */
+#ifndef HARDEN_CANARY
+#define HARDEN_CANARY   0
+#endif
+#ifndef HARDEN_JUNK
+#define HARDEN_JUNK     0
+#endif
+#ifndef HARDEN_GUARD
+#define HARDEN_GUARD    0
+#endif
+#define CANARY_SIZE     (HARDEN_CANARY ? WSIZE : 0)
+#define CANARYP(bp)     ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
+#define CANARY(bp)      ((unsigned)((size_t)(bp) >> 3) * 0x9E3779B1u ^ canarySecret)
+#define SET_CANARY(bp) \
+    do { if (HARDEN_CANARY) PUT(CANARYP(bp), CANARY(bp)); } while (0)
+#define CHECK_CANARY(bp) \
+    do { if (HARDEN_CANARY && GET(CANARYP(bp)) != CANARY(bp)) canary_fail(bp); } while (0)
+#if HARDEN_JUNK
+#define JUNK(bp, size)  memset(bp, junk_byte(), MIN(size, HARDEN_JUNK))
+#else
+#define JUNK(bp, size)
+#endif
+
+/* Sampled heap checking, off by default. Blocks checked per call, and
+ * calls between full mm_checkheap runs. Change at run time with
+ * mm_mallopt(MM_CHECK_SLICE) and mm_mallopt(MM_CHECK_FULL) */
+#ifndef CHECK_SLICE
+#define CHECK_SLICE     0
+#endif
+#ifndef CHECK_FULL
+#define CHECK_FULL      0
+#endif
+#define sample_checkheap(lineno) \
+    do { if (checkSlice | checkFull) check_sample(lineno); } while (0)
+
+/* Move the check cursor to the start of block bp if bp swallowed the
+ * block it pointed at */
+#define CHECK_SNAP(bp, size) \
+    do { if (checkCursor > (char *)(bp) && checkCursor < (char *)(bp) + (size)) \
+             checkCursor = (char *)(bp); } while (0)
+
+/* Heap profiler hooks. Count the bytes handed out down to the next sample,
+ * and drop the sample of a block that goes away */
+#define PROF_ALLOC(bp, size) \
+    do { if ((profLeft -= (long)(size)) < 0) profLeft = mm_prof_sample(bp, size); } while (0)
+#define PROF_FREE(bp) \
+    do { if (mm_prof_live) mm_prof_forget(bp); } while (0)
+
+/* Trace recorder hooks */
+#define TRACE_ALLOC(bp, size, align) \
+    do { if (mm_trace_on) mm_trace_alloc(bp, size, align); } while (0)
+#define TRACE_FREE(bp) \
+    do { if (mm_trace_on) mm_trace_free(bp); } while (0)
+
+/* Given a pointer into the heap, find its page index and the page start */
+#define SLAB_PAGE(p)    (((size_t)(p) >> SLAB_SHIFT) - ((size_t)freeLists >> SLAB_SHIFT))
+#define SLAB_BASE(p)    ((char *)((size_t)(p) & ~(size_t)(SLAB_SIZE - 1)))
+#if SLAB_ALLOC
+#define IS_SLAB(p)      ((slabMap[SLAB_PAGE(p) / 64] >> (SLAB_PAGE(p) % 64)) & 1)
+#else
+#define IS_SLAB(p)      0
+#endif
 
-/* Given free block ptr bp, get pointers of next blocks */
-#define NEXT(bp)            ((void *)(*(size_t*)(bp)))
-#define SET_NEXT(bp, next)  ((*(size_t*)(bp)) = (size_t)(next))
-#define FREELIST_COUNT      12
 /* Global variables */
 static char *heap_listp = 0;    /* Pointer to first block */  
 static char *epilogue;          /* pointer to epilogue block */
 static char *freeLists;         /* Pointer to start of freelist segment in heap*/
+static char *link_base;         /* Base address of free list offsets */
+static unsigned long freeMap;   /* bit i set iff free list i is non-empty */
+#if SLAB_ALLOC
+static char *slabLists;         /* Pointer to partial slab list heads in heap */
+static unsigned long slabMap[MAX_HEAP / SLAB_SIZE / 64];
+static unsigned slabSeen[SLAB_CLASSES]; /* requests per class, up to SLAB_WARMUP */
+#endif
+#if MMAP_THRESHOLD
+static char *mapList;           /* Most recently mapped block */
+#endif
+#if TRIM_THRESHOLD
+static int trimStreak;          /* frees in a row with a large free last block */
+#endif
+#if RELEASE_THRESHOLD
+static size_t dirty;            /* Bytes freed into large blocks since purge */
+static unsigned purgeCount;     /* purges so far, from PURGE_DONE up */
+#endif
+static int deferCoalesce;       /* MM_DEFER_COALESCE option */
+static char *quickLists[QUICK_COUNT];   /* Parked blocks by size / 8 */
+static size_t quickBytes;       /* Total size of parked blocks */
+static size_t freeBytes;        /* Bytes in free blocks, for mm_info */
+static unsigned long extendCount;   /* extend_heap calls */
+static size_t growSize;         /* Bytes malloc extends the heap by */
+static unsigned long growMark;  /* fitCount when the heap last ran out */
+static unsigned long fitCount;      /* find_fit calls */
+static unsigned long probeCount;    /* free blocks looked at by find_fit */
+static int checkSlice = CHECK_SLICE;    /* MM_CHECK_SLICE option */
+static int checkFull = CHECK_FULL;      /* MM_CHECK_FULL option */
+static int checkCalls;          /* Calls since the last full check */
+static char *checkCursor;       /* Next block for the sampled checker */
+static int checkList;           /* Next list head for the sampled checker */
+static int profRate;            /* MM_PROFILE option */
+static long profLeft = LONG_MAX;    /* Bytes until the next profile sample */
+static unsigned canarySecret;   /* Mixed into every canary */
+static unsigned junkSeed;       /* State of the junk byte generator */
 
 
 /* Function prototypes for internal helper routines */
 static int in_heap(void *bp);
 static int aligned(void *bp);
+static int check_block(char *bp, int lineno);
+static void check_links(char *bp, int lineno);
+static void check_list(int index, int lineno);
+static void check_sample(int lineno);
 static void *extend_heap(size_t words);
+static size_t grow_size(size_t asize);
 static void place(void *bp, size_t asize);
+static void shrink(void *bp, size_t asize);
+static void carve(void *fp, void *bp, size_t asize);
+static char *alloc_aligned(size_t asize, size_t align);
+static char *align_fit(char *fp, size_t align);
+static void *resize(void *ptr, size_t size);
+static void canary_fail(void *bp);
+static int junk_byte(void);
+static size_t adjust_size(size_t size);
 static void *find_fit(size_t asize);
+static void *find_aligned_fit(size_t asize, size_t align, char **bpp);
 static void *coalesce(void *bp);
 static void *list_insert(void *bp);
+static void free_block(void *bp);
+static void quick_flush(void);
+static void trim(void *bp, size_t freed);
+#if RELEASE_THRESHOLD
+static void purge(void);
+static void purge_block(char *bp);
+#endif
 static void list_remove(void *bp);
+static int size_class(size_t size);
 static void *find_list(size_t size);
+static size_t class_min(int index);
+static char *splay(char *t, size_t size, char *addr);
+static void tree_insert(char *bp);
+static void tree_remove(char *bp);
+static char *tree_fit(size_t asize);
+static char *tree_next(size_t size, char *addr);
+static char *tree_walk(char **cur);
+static int tree_check(char *bp, char *lo, char *hi, int lineno);
+#if SLAB_ALLOC
+static void *slab_alloc(size_t size);
+static void slab_free(void *bp);
+static char *slab_new(int cls);
+#endif
+#if MMAP_THRESHOLD
+static void *map_alloc(size_t size);
+static void *map_realloc(void *bp, size_t size);
+static void map_free(void *bp);
+#endif
 
 
 /* 
@@ -94,19 +473,52 @@ static void *find_list(size_t size);
  */
 int mm_init(void) {
     /* Create the initial empty heap */
-    if ((freeLists = mem_sbrk(FREELIST_COUNT*DSIZE+2*WSIZE)) == (void *)-1) 
+    if ((freeLists = mem_sbrk(FREELIST_BYTES+SLAB_BYTES+2*WSIZE)) == (void *)-1) 
         return -1;
 
     /* initialise free lists to point to null*/
-    memset(freeLists, 0, FREELIST_COUNT*DSIZE);
+    memset(freeLists, 0, FREELIST_BYTES);
+    freeMap = 0;
+    link_base = freeLists - WSIZE;
+
+#if SLAB_ALLOC
+    slabLists = freeLists+FREELIST_BYTES;
+    memset(slabLists, 0, SLAB_BYTES);
+    memset(slabMap, 0, sizeof(slabMap));
+    memset(slabSeen, 0, sizeof(slabSeen));
+#endif
+
+#if MMAP_THRESHOLD
+    mapList = NULL;
+#endif
+#if TRIM_THRESHOLD
+    trimStreak = 0;
+#endif
+#if RELEASE_THRESHOLD
+    dirty = 0;
+    purgeCount = PURGE_DONE;
+#endif
+    memset(quickLists, 0, sizeof(quickLists));
+    quickBytes = 0;
+    freeBytes = 0;
+    extendCount = fitCount = probeCount = 0;
+    growSize = CHUNKSIZE;
+    growMark = 0;
 
     /* set heap pointer to end of free list */
-    heap_listp = freeLists+FREELIST_COUNT*DSIZE;
+    heap_listp = freeLists+FREELIST_BYTES+SLAB_BYTES;
 
-    PUT(heap_listp, PACK(0, 1, 1));             /* Prolgue Footer*/
-    PUT(heap_listp + WSIZE, PACK(0, 1, 1));     /* Epilogue header */ 
+    PUT(heap_listp, PACK(0, PREV_ALLOC, 1));            /* Prolgue Footer*/
+    PUT(heap_listp + WSIZE, PACK(0, PREV_ALLOC, 1));    /* Epilogue header */ 
     heap_listp += 2*WSIZE;     
     epilogue = heap_listp;        
+    checkCursor = heap_listp;
+    checkCalls = checkList = 0;
+    profLeft = mm_prof_start(profRate);
+    mm_region_heap_init();
+    canarySecret = (unsigned)(((size_t)__builtin_frame_address(0) ^ (size_t)&canarySecret) *
+                              0x9E3779B97F4A7C15ULL >> 32);
+    junkSeed = canarySecret | 1;
 
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
     if (extend_heap(CHUNKSIZE) == NULL) 
@@ -125,34 +537,67 @@ void *malloc(size_t size) {
     dbg_checkheap(__LINE__);
 
     size_t asize;      /* Adjusted block size */
-    size_t extendsize; /* Amount to extend heap if no fit */
     char *bp;      
 
     if (heap_listp == 0){
         mm_init();
     }
+    sample_checkheap(__LINE__);
     /* Ignore spurious requests */
     if (size == 0) {
         dbg_checkheap(__LINE__);
         return NULL;
     }
 
+#if MMAP_THRESHOLD
+    if (size >= MMAP_THRESHOLD && (bp = map_alloc(size)) != NULL) {
+        PROF_ALLOC(bp, size);
+        TRACE_ALLOC(bp, size, 0);
+        dbg_checkheap(__LINE__);
+        return bp;
+    }
+#endif
+#if SLAB_ALLOC
+    if (size <= SLAB_MAX && (bp = slab_alloc(size)) != NULL) {
+        PROF_ALLOC(bp, size);
+        TRACE_ALLOC(bp, size, 0);
+        dbg_checkheap(__LINE__);
+        return bp;
+    }
+#endif
+
+    /* The heap never grows past MAX_HEAP, and a larger size would wrap
+       in adjust_size */
+    if (size > MAX_HEAP)
+        return NULL;
 
     /* Adjust block size to include overhead and alignment reqs. */
-    if (size + WSIZE <= MINSIZE)
-        asize = MINSIZE;                                      
-    else
-        asize = ALIGN(size+WSIZE);
+    asize = adjust_size(size);
+
+    /* Reuse a parked block of exactly this size */
+    if (asize <= QUICK_MAX && (bp = quickLists[asize / ALIGNMENT]) != NULL) {
+        quickLists[asize / ALIGNMENT] = NEXT(bp);
+        quickBytes -= asize;
+        SET_CANARY(bp);
+        PROF_ALLOC(bp, size);
+        TRACE_ALLOC(bp, size, 0);
+        dbg_checkheap(__LINE__);
+        return bp;
+    }
 
-    /* Search the free list for a fit */
+    /* Search the free list for a fit, coalescing parked blocks first if
+       there is none */
     bp = find_fit(asize);
+    if (bp == NULL && quickBytes) {
+        quick_flush();
+        bp = find_fit(asize);
+    }
 
     /* No fit found. Get more memory and place the block */
     if (bp == NULL) { 
-        extendsize = MAX(asize,CHUNKSIZE);
         dbg_printf("malloc bp null\n");
 
-        if ((bp = extend_heap(extendsize)) == NULL)  
+        if ((bp = extend_heap(grow_size(asize))) == NULL)  
             return NULL;  
     }
 
@@ -161,6 +606,9 @@ void *malloc(size_t size) {
 
     /* Place malloc block into free block */
     place(bp, asize);     
+    SET_CANARY(bp);
+    PROF_ALLOC(bp, size);
+    TRACE_ALLOC(bp, size, 0);
 
     dbg_printf("Malloc size %zd on address %p.\n", asize, bp);
     dbg_checkheap(__LINE__);                            
@@ -178,24 +626,67 @@ void free(void *bp) {
         mm_init();
         return;
     }
+    sample_checkheap(__LINE__);
+    PROF_FREE(bp);
+    TRACE_FREE(bp);
+#if MMAP_THRESHOLD
+    if (IS_MAPPED(bp)) {
+        map_free(bp);
+        dbg_checkheap(__LINE__);
+        return;
+    }
+#endif
+#if SLAB_ALLOC
+    if (IS_SLAB(bp)) {
+        JUNK(bp, SLAB_OBJ(GET(SLAB_CLASS(SLAB_BASE(bp)))));
+        slab_free(bp);
+        dbg_checkheap(__LINE__);
+        return;
+    }
+#endif
     size_t size = GET_SIZE(HDRP(bp));
+    CHECK_CANARY(bp);
+    JUNK(bp, size - WSIZE - CANARY_SIZE);
+
+    /* Park small blocks when coalescing is deferred */
+    if (deferCoalesce && size <= QUICK_MAX) {
+        SET_NEXT(bp, quickLists[size / ALIGNMENT]);
+        quickLists[size / ALIGNMENT] = bp;
+        quickBytes += size;
+        if (quickBytes >= QUICK_LIMIT)
+            quick_flush();
+        dbg_checkheap(__LINE__);
+        return;
+    }
 
-    int prev_alloc = GET_PREV_ALLOC(HDRP(bp));
-    PUT(HDRP(bp), PACK(size, prev_alloc, 0));
-    PUT(FTRP(bp), PACK(size, prev_alloc, 0));
-
-    bp = coalesce(bp);
-    SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)), 0);
-    dbg_printf("hdr %d on address %p.\n", GET(HDRP(NEXT_BLKP(bp))), NEXT_BLKP(bp));
+    free_block(bp);
     dbg_printf("free size %zd on address %p.\n", size, bp);
     dbg_checkheap(__LINE__);
 
 }
 
 /*
- * realloc - Naive implementation of realloc
+ * realloc - Resize a block, recording the request as a whole
  */
 void *realloc(void *ptr, size_t size) {
+    void *bp;
+
+    if (!mm_trace_on)
+        return resize(ptr, size);
+    mm_trace_on = 0;
+    bp = resize(ptr, size);
+    mm_trace_on = 1;
+    mm_trace_realloc(ptr, bp, size);
+    return bp;
+}
+
+/*
+ * resize - Resize a block in place when possible: shrink by splitting
+ *          off the tail, grow into a free successor, and grow the last
+ *          block by extending the heap by only the missing bytes. Fall
+ *          back to malloc, copy and free otherwise
+ */
+static void *resize(void *ptr, size_t size) {
     size_t oldsize;
     void *newptr;
 
@@ -209,6 +700,87 @@ void *realloc(void *ptr, size_t size) {
     if(ptr == NULL) {
         return mm_malloc(size);
     }
+    sample_checkheap(__LINE__);
+
+#if MMAP_THRESHOLD
+    if (IS_MAPPED(ptr)) {
+        if ((newptr = map_realloc(ptr, size)) != NULL) {
+            PROF_FREE(ptr);
+            PROF_ALLOC(newptr, size);
+        }
+        return newptr;
+    }
+#endif
+#if SLAB_ALLOC
+    if (IS_SLAB(ptr)) {
+        int cls = GET(SLAB_CLASS(SLAB_BASE(ptr)));
+        if (size <= SLAB_OBJ(cls) && (cls == 0 || size > SLAB_OBJ(cls-1))) {
+            PROF_FREE(ptr);
+            PROF_ALLOC(ptr, size);
+            return ptr;
+        }
+        if ((newptr = mm_malloc(size)) == NULL)
+            return 0;
+        memcpy(newptr, ptr, size < SLAB_OBJ(cls) ? size : SLAB_OBJ(cls));
+        PROF_FREE(ptr);
+        slab_free(ptr);
+        return newptr;
+    }
+#endif
+
+    /* Only a mapping can hold more than MAX_HEAP, so move the block */
+    if (size > MAX_HEAP) {
+        CHECK_CANARY(ptr);
+        if ((newptr = mm_malloc(size)) != NULL) {
+            memcpy(newptr, ptr, GET_SIZE(HDRP(ptr)) - WSIZE);
+            mm_free(ptr);
+        }
+        return newptr;
+    }
+
+    size_t asize = adjust_size(size);
+    size_t csize = GET_SIZE(HDRP(ptr));
+    CHECK_CANARY(ptr);
+
+    /* Shrink in place */
+    if (asize <= csize) {
+        shrink(ptr, asize);
+        SET_CANARY(ptr);
+        PROF_FREE(ptr);
+        PROF_ALLOC(ptr, size);
+        dbg_checkheap(__LINE__);
+        return ptr;
+    }
+
+    char *next = NEXT_BLKP(ptr);
+    size_t nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+
+    /* Last block in the heap, possibly followed by a free block: extend the
+       heap by the shortfall, which coalesces with that free block */
+    if (csize + nsize < asize && 
+        GET_SIZE(HDRP(nsize ? NEXT_BLKP(next) : next)) == 0) {
+        if (extend_heap(asize - csize - nsize) == NULL)
+            return NULL;
+        nsize = GET_SIZE(HDRP(next));
+    }
+
+    /* Grow into the free successor. When that is the last block keep a
+       leftover smaller than CHUNKSIZE attached, otherwise the next small
+       malloc lands there and pins the block away from the heap end */
+    if (csize + nsize >= asize) {
+        list_remove(next);
+        int last = GET_SIZE(HDRP(NEXT_BLKP(next))) == 0;
+        PUT(HDRP(ptr), PACK(csize + nsize, GET_PREV(HDRP(ptr)), 1));
+        CHECK_SNAP(ptr, csize + nsize);
+        SET_PREV_INFO(HDRP(NEXT_BLKP(ptr)), PREV_ALLOC);
+        if (!last || csize + nsize - asize >= CHUNKSIZE)
+            shrink(ptr, asize);
+        SET_CANARY(ptr);
+        PROF_FREE(ptr);
+        PROF_ALLOC(ptr, size);
+        dbg_checkheap(__LINE__);
+        return ptr;
+    }
 
     newptr = mm_malloc(size);
 
@@ -218,7 +790,7 @@ void *realloc(void *ptr, size_t size) {
     }
 
     /* Copy the old data. */
-    oldsize = GET_SIZE(HDRP(ptr));
+    oldsize = csize - WSIZE;
     if(size < oldsize) oldsize = size;
     memcpy(newptr, ptr, oldsize);
 
@@ -229,17 +801,189 @@ void *realloc(void *ptr, size_t size) {
 }
 
 /*
- * calloc - allocate memory and set it to zero.
+ * mm_mallopt - Set allocator option param to value, like mallopt. Return 1
+ *              on success and 0 for an unknown option
+ */
+int mm_mallopt(int param, int value) {
+    switch (param) {
+    case MM_DEFER_COALESCE:
+        if (!value && heap_listp)
+            quick_flush();
+        deferCoalesce = value;
+        return 1;
+    case MM_CHECK_SLICE:
+        checkSlice = value;
+        return 1;
+    case MM_CHECK_FULL:
+        checkFull = value;
+        checkCalls = 0;
+        return 1;
+    case MM_PROFILE:
+        profRate = value;
+        profLeft = mm_prof_start(value);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * memalign - Allocate a block with at least size bytes of payload aligned
+ *            to alignment bytes, which must be a power of two. Aligned
+ *            blocks always come from the heap and are freed as usual, so
+ *            neither size nor alignment may exceed the heap
+ */
+void *memalign(size_t alignment, size_t size) {
+    char *bp;
+
+    if (alignment <= ALIGNMENT)
+        return malloc(size);
+    if (size == 0 || (alignment & (alignment - 1)) ||
+        size > MAX_HEAP || alignment > MAX_HEAP)
+        return NULL;
+    if (heap_listp == 0)
+        mm_init();
+
+    if ((bp = alloc_aligned(adjust_size(size), alignment)) != NULL) {
+        SET_CANARY(bp);
+        PROF_ALLOC(bp, size);
+        TRACE_ALLOC(bp, size, alignment);
+    }
+
+    dbg_printf("Memalign size %zd align %zd on address %p.\n", size, alignment, bp);
+    dbg_checkheap(__LINE__);
+    return bp;
+}
+
+/*
+ * posix_memalign - memalign that stores the block in *memptr. Return
+ *                  EINVAL unless alignment is a power of two multiple of
+ *                  sizeof(void *), and ENOMEM when out of memory
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    void *bp;
+
+    if (alignment == 0 || alignment % sizeof(void *) ||
+        (alignment & (alignment - 1)))
+        return EINVAL;
+    if ((bp = memalign(alignment, size)) == NULL && size != 0)
+        return ENOMEM;
+    *memptr = bp;
+    return 0;
+}
+
+/*
+ * aligned_alloc - C11 aligned allocation. Return NULL with errno EINVAL
+ *                 unless alignment is a power of two
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(alignment, size);
+}
+
+/*
+ * calloc - allocate memory and set it to zero. Mapped regions start out
+ *          zero. Heap memory from mem_zero_lo up was never written before
+ *          this call, except for the links and footer malloc put into
+ *          the free block, so only those and the part below it are cleared
  */
 void *calloc(size_t nmemb, size_t size) {
+    char *zero = mem_zero_lo();
+    char *bp;
+
+    if (nmemb && size > SIZE_MAX / nmemb)
+        return NULL;
     size *= nmemb;
+    if ((bp = malloc(size)) == NULL)
+        return NULL;
+
+#if MMAP_THRESHOLD
+    if (IS_MAPPED(bp))
+        return bp;
+#endif
+#if SLAB_ALLOC
+    if (IS_SLAB(bp)) {
+        memset(bp, 0, size);
+        return bp;
+    }
+#endif
+    if (bp + size <= zero) {
+        memset(bp, 0, size);
+        return bp;
+    }
+
+    size_t bsize = GET_SIZE(HDRP(bp));
+    size_t below = bp < zero ? zero - bp : 0;
+    memset(bp, 0, MIN(size, MAX(below, DSIZE)));
+    if (size > bsize - DSIZE)                   /* footer of an unsplit block */
+        memset(bp + bsize - DSIZE, 0, size - (bsize - DSIZE));
+
+    dbg_printf("Calloc size %zd on address %p cleared %zd bytes.\n", size, bp, below);
+    return bp;
+}
+
+/*
+ * mm_info - Fill in allocator statistics. The totals are kept up to date
+ *           all the time. The free bytes per size class are added up by
+ *           walking the free lists and the tree, which takes time linear
+ *           in the number of free blocks. Mini blocks, which are on no
+ *           list, make up the rest of the free bytes
+ */
+void mm_info(mm_info_t *info) {
+    memset(info, 0, sizeof(*info));
+    if (heap_listp == 0)
+        return;
 
-    void *ptr = malloc(size);
-    if (!ptr) return NULL;
+    info->heap = mem_heapsize();
+#if MMAP_THRESHOLD
+    info->mapped = mem_mapsize();
+#endif
+    info->classes = FREELIST_COUNT;
+    size_t listed = 0;
+    char *bp, *cur;
+    for (int i = 0; i < FREELIST_COUNT; i++) {
+        if (i == TREE_CLASS)
+            for (cur = TREE_ROOT; (bp = tree_walk(&cur)) != NULL; )
+                info->class_free[i] += GET_SIZE(HDRP(bp));
+        else
+            for (bp = NEXT(freeLists + i*WSIZE); bp; bp = NEXT(bp))
+                info->class_free[i] += GET_SIZE(HDRP(bp));
+        info->class_min[i] = class_min(i);
+        listed += info->class_free[i];
+    }
+    info->class_free[size_class(MINSIZE)] += freeBytes - listed;
+    info->free_bytes = freeBytes;
+    info->parked = quickBytes;
+    info->in_use = (epilogue - heap_listp) - info->free_bytes - quickBytes + info->mapped;
+
+    if (freeMap) {
+        int top = 63 - __builtin_clzl(freeMap);
+        if (top == TREE_CLASS) {
+            for (bp = TREE_ROOT; RIGHT(bp); bp = RIGHT(bp))
+                ;
+            info->largest_free = GET_SIZE(HDRP(bp));
+        }
+        else {
+            for (bp = NEXT(freeLists + top*WSIZE); bp; bp = NEXT(bp))
+                info->largest_free = MAX(info->largest_free, GET_SIZE(HDRP(bp)));
+        }
+        info->fragmentation = 1.0 - (double)info->largest_free / info->free_bytes;
+    }
 
-    memset(ptr, 0, size);
+    info->extends = extendCount;
+    info->fits = fitCount;
+    info->probes = probeCount;
+}
 
-    return ptr;
+/*
+ * mm_size_class - Size class of a request for size bytes, numbered as in
+ *                 mm_info_t
+ */
+int mm_size_class(size_t size) {
+    return size_class(adjust_size(size));
 }
 
 /* 
@@ -264,40 +1008,25 @@ void mm_checkheap(int lineno) {
     // block aligned
     void *bp;
     int free_count = 0;
+    size_t free_bytes = 0;
     for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        if (!in_heap(bp)) {
-            printf("Block not in heap\n");
-            printf("Error in line %d\n", lineno);
-        }
-        if (!aligned(bp)) {
-            printf("Block not aligned\n");
-            printf("Error in line %d\n", lineno);
-        }
-        if (GET_SIZE(HDRP(bp)) < MINSIZE) {
-            printf("Block too small, %d instead of %d\n", GET_SIZE(HDRP(bp)), MINSIZE);
-            printf("Error in line %d\n", lineno);
-        }
         if (!GET_ALLOC(HDRP(bp))) {
-            free_count++;
-            if (!GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
-                printf("two contiguous free blocks not yet coalesced\n");
-                printf("Error in line %d\n", lineno);
-            }
-            if (GET(HDRP(bp)) != GET(FTRP(bp))) {
-                printf("Mismatch in header and footer contents\n");
-                printf("Error in line %d\n", lineno);
-            }
+            free_count += GET_SIZE(HDRP(bp)) > MINSIZE;
+            free_bytes += GET_SIZE(HDRP(bp));
         } 
-        if (GET_ALLOC(HDRP(bp)) != GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)))) {
-            printf("Mismatch in alloc of current block %p and prev alloc of next block\n", bp);
-            printf("alloc: %d, prev_aloc: %d\n", GET_ALLOC(HDRP(bp)), GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))));
-            printf("Error in line %d\n", lineno);
-        }
+        if (!check_block(bp, lineno))
+            break;
     }
 
-    void *freeListEnd = freeLists+(FREELIST_COUNT*DSIZE);
+    void *freeListEnd = freeLists+(FREELIST_COUNT*WSIZE);
 
-    for (void *list = freeLists; list < freeListEnd; list+=DSIZE) {
+    for (void *list = freeLists; list < freeListEnd; list+=WSIZE) {
+        int index = ((char *)list - freeLists) / WSIZE;
+        check_list(index, lineno);
+        if (index == TREE_CLASS) {
+            free_count -= tree_check(TREE_ROOT, NULL, NULL, lineno);
+            continue;
+        }
         void *curr = list;
         while (NEXT(curr)) {
             free_count--;
@@ -306,6 +1035,14 @@ void mm_checkheap(int lineno) {
                 printf("Allocated block in free list\n");
                 printf("Error in line %d\n", lineno);
             }
+            if (find_list(GET_SIZE(HDRP(bp))) != list) {
+                printf("Block of size %d in wrong list %d\n", GET_SIZE(HDRP(bp)), index);
+                printf("Error in line %d\n", lineno);
+            }
+            if (PREV(bp) != curr) {
+                printf("Prev link of %p does not point back to %p\n", bp, curr);
+                printf("Error in line %d\n", lineno);
+            }
             curr = NEXT(curr);
         }
     }
@@ -315,10 +1052,14 @@ void mm_checkheap(int lineno) {
         printf("Free list size and number of free blocks mismatch, %d diffrence\n", free_count);
         printf("Error in line %d\n", lineno);
     }
+    if ((free_bytes -= freeBytes) != 0) {
+        printf("Free byte counters off by %zd\n", (ssize_t)free_bytes);
+        printf("Error in line %d\n", lineno);
+    }
     
-    for (void *list = freeLists; list < freeListEnd; list+=DSIZE) {
+    for (void *list = freeLists; list < freeListEnd - WSIZE; list+=WSIZE) {
         void *slow = list, *fast = list;
-        while (NEXT(fast) && NEXT(NEXT(fast))) {
+        while (GET(fast) && GET(NEXT(fast))) {
             slow = NEXT(slow);
             fast = NEXT(NEXT(fast));
             if (slow == fast) {
@@ -329,6 +1070,37 @@ void mm_checkheap(int lineno) {
         }
     }
 
+    size_t parked = 0;
+    for (int i = 0; i < QUICK_COUNT; i++) {
+        for (char *bp = quickLists[i]; bp; bp = NEXT(bp)) {
+            if (!in_heap(bp) || !GET_ALLOC(HDRP(bp)) ||
+                GET_SIZE(HDRP(bp)) != (unsigned)i * ALIGNMENT) {
+                printf("Bad parked block %p in quick list %d\n", bp, i);
+                printf("Error in line %d\n", lineno);
+                break;
+            }
+            parked += GET_SIZE(HDRP(bp));
+        }
+    }
+    if (parked != quickBytes) {
+        printf("Quick lists hold %zu bytes, not %zu\n", parked, quickBytes);
+        printf("Error in line %d\n", lineno);
+    }
+
+#if MMAP_THRESHOLD
+    for (char *bp = mapList, *prev = NULL; bp; prev = bp, bp = MAP_NEXT(bp)) {
+        if (in_heap(bp) || !mem_in_map(MAP_BASE(bp), MAP_BASE(bp) + MAP_SIZE(bp) - 1)) {
+            printf("Mapped block %p not in a mapped region\n", bp);
+            printf("Error in line %d\n", lineno);
+            break;
+        }
+        if (!aligned(bp) || MAP_PREV(bp) != prev) {
+            printf("Mapped block %p misaligned or badly linked\n", bp);
+            printf("Error in line %d\n", lineno);
+        }
+    }
+#endif
+
 }
 
 /* 
@@ -348,72 +1120,252 @@ static int in_heap(void *bp) {
 static int aligned(void *bp) {
     return !((size_t)bp & 0x7);
 }
-/* 
- * The remaining routines are internal helper routines 
- */
 
-/* 
- * extend_heap - Extend heap with free block and return its block pointer
+/*
+ * check_block - check block bp on its own and against its neighbours and
+ *               free list links. Return 0 if its size is too broken to
+ *               step to the next block
  */
-static void *extend_heap(size_t size) {
-    char *bp;
-
-    if ((long)(bp = mem_sbrk(size)) == -1)  
-        return NULL;                                        
-
-    int prev_alloc = GET_PREV_ALLOC(HDRP(epilogue));
-    /* Initialize free block header/footer and the epilogue header */
-    PUT(HDRP(bp), PACK(size, prev_alloc, 0));         /* Free block header */   
-    PUT(FTRP(bp), PACK(size, prev_alloc, 0));         /* Free block footer */   
-    epilogue += size;
-    PUT(HDRP(epilogue), PACK(0, 0, 1)); /* New epilogue header */ 
+static int check_block(char *bp, int lineno) {
+    size_t size = GET_SIZE(HDRP(bp));
 
-    /* Coalesce if the previous block was free */
-    return coalesce(bp);                                          
+    if (!in_heap(bp)) {
+        printf("Block not in heap\n");
+        printf("Error in line %d\n", lineno);
+        return 0;
+    }
+    if (!aligned(bp)) {
+        printf("Block not aligned\n");
+        printf("Error in line %d\n", lineno);
+    }
+    if (size < MINSIZE || bp + size > epilogue) {
+        printf("Block %p has bad size %zd\n", bp, size);
+        printf("Error in line %d\n", lineno);
+        return 0;
+    }
+    if (!GET_ALLOC(HDRP(bp))) {
+        if (!GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
+            printf("two contiguous free blocks not yet coalesced\n");
+            printf("Error in line %d\n", lineno);
+        }
+        if (size > MINSIZE && GET(HDRP(bp)) != GET(FTRP(bp))) {
+            printf("Mismatch in header and footer contents\n");
+            printf("Error in line %d\n", lineno);
+        }
+        check_links(bp, lineno);
+    } 
+#if HARDEN_CANARY
+    else if (!IS_SLAB(bp) && GET(CANARYP(bp)) != CANARY(bp)) {
+        printf("Canary of block %p clobbered\n", bp);
+        printf("Error in line %d\n", lineno);
+    }
+#endif
+    if (GET_ALLOC(HDRP(bp)) != GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)))) {
+        printf("Mismatch in alloc of current block %p and prev alloc of next block\n", bp);
+        printf("alloc: %d, prev_aloc: %d\n", GET_ALLOC(HDRP(bp)), GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))));
+        printf("Error in line %d\n", lineno);
+    }
+    if ((size == MINSIZE) != GET_PREV_MINI(HDRP(NEXT_BLKP(bp)))) {
+        printf("Mismatch in size of current block %p and prev mini of next block\n", bp);
+        printf("Error in line %d\n", lineno);
+    }
+    return 1;
 }
 
 /*
- * coalesce - Boundary tag coalescing. Return ptr to coalesced block
+ * check_links - check that the neighbours of free block bp in its list
+ *               or tree are free blocks of the right class that link back
  */
-static void *coalesce(void *bp) {
-    int prev_alloc = GET_PREV_ALLOC(HDRP(bp));
-    int next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+static void check_links(char *bp, int lineno) {
     size_t size = GET_SIZE(HDRP(bp));
+    int index = size_class(size);
+    char *next, *prev;
 
-    if (prev_alloc && next_alloc) {            /* Case 1 */
-        list_insert(bp);
-        return bp;
+    if (size == MINSIZE)            /* on no list */
+        return;
+    if (index == TREE_CLASS) {
+        next = LEFT(bp);
+        prev = RIGHT(bp);
+        if ((next && (!in_heap(next) || GET_ALLOC(HDRP(next)) ||
+                      !KEY_BEFORE(GET_SIZE(HDRP(next)), next, bp))) ||
+            (prev && (!in_heap(prev) || GET_ALLOC(HDRP(prev)) ||
+                      !KEY_AFTER(GET_SIZE(HDRP(prev)), prev, bp)))) {
+            printf("Bad children of tree node %p\n", bp);
+            printf("Error in line %d\n", lineno);
+        }
+        return;
     }
 
-    else if (prev_alloc && !next_alloc) {      /* Case 2 */
-        list_remove(NEXT_BLKP(bp));
-
-        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(bp), PACK(size, 1, 0));
-        PUT(FTRP(bp), PACK(size, 1, 0));
+    next = NEXT(bp);
+    if (next && (!in_heap(next) || GET_ALLOC(HDRP(next)) ||
+                 size_class(GET_SIZE(HDRP(next))) != index)) {
+        printf("Bad next link of free block %p\n", bp);
+        printf("Error in line %d\n", lineno);
     }
-
-    else if (!prev_alloc && next_alloc) {      /* Case 3 */
-        list_remove(PREV_BLKP(bp));
-        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-        int prev_prev_alloc = GET_PREV_ALLOC(HDRP(PREV_BLKP(bp)));
-        PUT(FTRP(bp), PACK(size, prev_prev_alloc, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, prev_prev_alloc, 0)); //
-        bp = PREV_BLKP(bp);
+    else if (next && PREV(next) != bp) {
+        printf("Next block %p does not link back to %p\n", next, bp);
+        printf("Error in line %d\n", lineno);
     }
-
-    else {                                     /* Case 4 */
-        list_remove(NEXT_BLKP(bp));
-        list_remove(PREV_BLKP(bp));
-        size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
-            GET_SIZE(FTRP(NEXT_BLKP(bp)));
-        int prev_prev_alloc = GET_PREV_ALLOC(HDRP(PREV_BLKP(bp)));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, prev_prev_alloc, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, prev_prev_alloc, 0));
-        bp = PREV_BLKP(bp);
+    prev = PREV(bp);
+    if (prev != freeLists + index*WSIZE &&
+        (!in_heap(prev) || GET_ALLOC(HDRP(prev)))) {
+        printf("Bad prev link of free block %p\n", bp);
+        printf("Error in line %d\n", lineno);
     }
-    list_insert(bp);
-
+    else if (NEXT(prev) != bp) {
+        printf("Prev block %p does not link to %p\n", prev, bp);
+        printf("Error in line %d\n", lineno);
+    }
+}
+
+/*
+ * check_list - check the head of free list index against freeMap
+ */
+static void check_list(int index, int lineno) {
+    char *bp = TO_PTR(GET(freeLists + index*WSIZE));
+
+    if (!bp != !(freeMap & (1UL << index))) {
+        printf("Free map bit %d does not match list %p\n", index, freeLists + index*WSIZE);
+        printf("Error in line %d\n", lineno);
+    }
+    if (bp && (!in_heap(bp) || GET_ALLOC(HDRP(bp)) ||
+               size_class(GET_SIZE(HDRP(bp))) != index)) {
+        printf("Bad first block %p in list %d\n", bp, index);
+        printf("Error in line %d\n", lineno);
+    }
+}
+
+/*
+ * check_sample - bounded check run on every call: the next checkSlice
+ *                blocks after checkCursor and the next list head, or
+ *                the whole heap every checkFull calls. Nothing is
+ *                checked before the heap exists
+ */
+static void check_sample(int lineno) {
+    if (heap_listp == 0)
+        return;
+    if (checkFull && ++checkCalls >= checkFull) {
+        checkCalls = 0;
+        mm_checkheap(lineno);
+        return;
+    }
+    if (checkSlice == 0)
+        return;
+
+    char *bp = checkCursor;
+    for (int i = 0; i < checkSlice; i++) {
+        if (bp >= epilogue)
+            bp = heap_listp;
+        if (!check_block(bp, lineno)) {
+            bp = heap_listp;
+            break;
+        }
+        bp = NEXT_BLKP(bp);
+    }
+    checkCursor = bp >= epilogue ? heap_listp : bp;
+
+    check_list(checkList, lineno);
+    checkList = (checkList + 1) % FREELIST_COUNT;
+}
+
+/*
+ * tree_check - check the subtree rooted at bp, whose nodes must all be
+ *              ordered between nodes lo and hi, and return its size
+ */
+static int tree_check(char *bp, char *lo, char *hi, int lineno) {
+    if (bp == NULL)
+        return 0;
+    if (!in_heap(bp) || GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < LARGE_LIMIT) {
+        printf("Bad block %p in free tree\n", bp);
+        printf("Error in line %d\n", lineno);
+        return 1;
+    }
+    if ((lo && !KEY_AFTER(GET_SIZE(HDRP(bp)), bp, lo)) ||
+        (hi && !KEY_BEFORE(GET_SIZE(HDRP(bp)), bp, hi))) {
+        printf("Block %p out of order in free tree\n", bp);
+        printf("Error in line %d\n", lineno);
+        return 1;
+    }
+    return 1 + tree_check(LEFT(bp), lo, bp, lineno) +
+               tree_check(RIGHT(bp), bp, hi, lineno);
+}
+/*
+ * The remaining routines are internal helper routines 
+ */
+
+/* 
+ * extend_heap - Extend heap by at least size bytes with a free block and
+ *               return its block pointer. mem_sbrk takes an int, so larger
+ *               sizes fail
+ */
+static void *extend_heap(size_t size) {
+    char *bp;
+
+    size = MAX(size, MINSIZE);
+    if (size > INT_MAX || (long)(bp = mem_sbrk(size)) == -1)  
+        return NULL;                                        
+    extendCount++;
+
+    unsigned prev = GET_PREV(HDRP(epilogue));
+    /* Initialize free block header/footer and the epilogue header */
+    PUT(HDRP(bp), PACK(size, prev, 0));         /* Free block header */   
+    if (size > MINSIZE)
+        PUT(FTRP(bp), PACK(size, prev, 0));     /* Free block footer */   
+    epilogue += size;
+    PUT(HDRP(epilogue), PACK(0, 0, 1)); /* New epilogue header */ 
+
+    /* Coalesce if the previous block was free */
+    bp = coalesce(bp);                                          
+    SET_PREV_INFO(HDRP(epilogue), MINI_BIT(GET_SIZE(HDRP(bp))));
+    return bp;
+}
+
+/*
+ * coalesce - Boundary tag coalescing. Return ptr to coalesced block
+ */
+static void *coalesce(void *bp) {
+    int prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    int next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t size = GET_SIZE(HDRP(bp));
+    unsigned prev = GET_PREV(HDRP(bp));
+
+    if (prev_alloc && next_alloc) {            /* Case 1 */
+        list_insert(bp);
+        return bp;
+    }
+
+    else if (prev_alloc && !next_alloc) {      /* Case 2 */
+        list_remove(NEXT_BLKP(bp));
+
+        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        PUT(HDRP(bp), PACK(size, prev, 0));
+        PUT(FTRP(bp), PACK(size, prev, 0));
+    }
+
+    else if (!prev_alloc && next_alloc) {      /* Case 3 */
+        char *prevp = PREV_BLKP(bp);
+        list_remove(prevp);
+        size += GET_SIZE(HDRP(prevp));
+        unsigned prev_prev = GET_PREV(HDRP(prevp));
+        PUT(FTRP(bp), PACK(size, prev_prev, 0));
+        PUT(HDRP(prevp), PACK(size, prev_prev, 0));
+        bp = prevp;
+    }
+
+    else {                                     /* Case 4 */
+        char *prevp = PREV_BLKP(bp);
+        list_remove(NEXT_BLKP(bp));
+        list_remove(prevp);
+        size += GET_SIZE(HDRP(prevp)) + 
+            GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        unsigned prev_prev = GET_PREV(HDRP(prevp));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, prev_prev, 0));
+        PUT(HDRP(prevp), PACK(size, prev_prev, 0));
+        bp = prevp;
+    }
+    CHECK_SNAP(bp, size);
+    list_insert(bp);
+
     return bp;
 }
 
@@ -423,95 +1375,853 @@ static void *coalesce(void *bp) {
  */
 static void place(void *bp, size_t asize) {
     size_t csize = GET_SIZE(HDRP(bp));   
-    int prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    unsigned prev = GET_PREV(HDRP(bp));
 
     if ((csize - asize) >= MINSIZE) { 
-        PUT(HDRP(bp), PACK(asize, prev_alloc, 1));
+        size_t rsize = csize - asize;
+        unsigned rprev = PREV_ALLOC | MINI_BIT(asize);
+        PUT(HDRP(bp), PACK(asize, prev, 1));
         bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(csize-asize, 1, 0));
-        PUT(FTRP(bp), PACK(csize-asize, 1, 0));
+        PUT(HDRP(bp), PACK(rsize, rprev, 0));
+        if (rsize > MINSIZE)
+            PUT(FTRP(bp), PACK(rsize, rprev, 0));
+        SET_PREV_INFO(HDRP(NEXT_BLKP(bp)), MINI_BIT(rsize));
         list_insert(bp);
     }
     else { 
-        PUT(HDRP(bp), PACK(csize, prev_alloc, 1));
+        PUT(HDRP(bp), PACK(csize, prev, 1));
         SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)), 1);
     }
 
 }
 
 /* 
- * find_fit - Find a fit for a block with asize bytes 
+ * shrink - Cut allocated block bp down to asize bytes and free the tail
+ *          if it would be at least minimum block size
  */
-static void *find_fit(size_t asize) {
-    /* get starting list */
-    void *list = find_list(asize);
-    
-    /* First-fit search */
-    void *freeListEnd = freeLists + FREELIST_COUNT*DSIZE;
-    dbg_printf("Find list size %ld on address %p endlist %p.\n", asize, list, freeListEnd);
+static void shrink(void *bp, size_t asize) {
+    size_t csize = GET_SIZE(HDRP(bp));
 
-    for (;list < freeListEnd; list +=DSIZE) {
-        void *curr = list;
-        while (NEXT(curr)) {
-            void *bp = NEXT(curr);
+    if ((csize - asize) < MINSIZE)
+        return;
+
+    size_t rsize = csize - asize;
+    unsigned rprev = PREV_ALLOC | MINI_BIT(asize);
+    PUT(HDRP(bp), PACK(asize, GET_PREV(HDRP(bp)), 1));
+    bp = NEXT_BLKP(bp);
+    PUT(HDRP(bp), PACK(rsize, rprev, 0));
+    if (rsize > MINSIZE)
+        PUT(FTRP(bp), PACK(rsize, rprev, 0));
+
+    bp = coalesce(bp);
+    SET_PREV_INFO(HDRP(NEXT_BLKP(bp)), MINI_BIT(GET_SIZE(HDRP(bp))));
+}
+
+/*
+ * free_block - Mark block bp free, coalesce it and give memory back
+ */
+static void free_block(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    unsigned prev = GET_PREV(HDRP(bp));
+
+    PUT(HDRP(bp), PACK(size, prev, 0));
+    if (size > MINSIZE)
+        PUT(FTRP(bp), PACK(size, prev, 0));
+
+    bp = coalesce(bp);
+    SET_PREV_INFO(HDRP(NEXT_BLKP(bp)), MINI_BIT(GET_SIZE(HDRP(bp))));
+    trim(bp, size);
+}
+
+/*
+ * quick_flush - Free and coalesce every parked block
+ */
+static void quick_flush(void) {
+    char *bp, *next;
+
+    for (int i = 0; i < QUICK_COUNT; i++) {
+        for (bp = quickLists[i]; bp; bp = next) {
+            next = NEXT(bp);
+            free_block(bp);
+        }
+        quickLists[i] = NULL;
+    }
+    quickBytes = 0;
+}
+
+/*
+ * trim - Give memory back after freeing freed bytes into free block bp.
+ *        A large last block is cut down to TRIM_KEEP bytes by shrinking
+ *        the heap once it stayed large for TRIM_FREES frees. Bytes freed
+ *        into other large blocks are counted, and every RELEASE_DIRTY of
+ *        them the large free blocks are purged
+ */
+static void trim(void *bp, size_t freed) {
+    (void)bp;
+    (void)freed;
+#if TRIM_THRESHOLD
+    char *last = GET_PREV_ALLOC(HDRP(epilogue)) ? NULL : PREV_BLKP(epilogue);
+
+    if (last == NULL || GET_SIZE(HDRP(last)) < TRIM_THRESHOLD)
+        trimStreak = 0;
+    else if (++trimStreak >= TRIM_FREES) {
+        size_t size = GET_SIZE(HDRP(last));
+        size_t cut = (size - TRIM_KEEP) & ~(mem_pagesize() - 1);
+        trimStreak = 0;
+        if (mem_sbrk_shrink(cut) == (void *)-1)
+            return;
+        list_remove(last);
+        size -= cut;
+        unsigned prev = GET_PREV(HDRP(last));
+        PUT(HDRP(last), PACK(size, prev, 0));
+        PUT(FTRP(last), PACK(size, prev, 0));
+        list_insert(last);
+        epilogue -= cut;
+        PUT(HDRP(epilogue), PACK(0, 0, 1));
+        return;
+    }
+    if (bp == last)
+        return;
+#endif
+#if RELEASE_THRESHOLD
+    if (GET_SIZE(HDRP(bp)) >= RELEASE_THRESHOLD && (dirty += freed) >= RELEASE_DIRTY)
+        purge();
+#endif
+}
+
+#if RELEASE_THRESHOLD
+/*
+ * purge - Release the whole pages of every free block of at least
+ *         RELEASE_THRESHOLD bytes that was already free and unchanged at
+ *         the previous purge, except those holding its links, mark and
+ *         footer. Blocks reused since then only get marked, so that hot
+ *         blocks do not lose their pages over and over
+ */
+static void purge(void) {
+    int index = size_class(RELEASE_THRESHOLD);
+    unsigned long nonempty = freeMap & (~0UL << index) & ~(1UL << TREE_CLASS);
+    char *bp, *cur;
+
+    purgeCount++;
+    while (nonempty) {
+        index = __builtin_ctzl(nonempty);
+        nonempty &= nonempty - 1;
+        for (bp = NEXT(freeLists + index*WSIZE); bp; bp = NEXT(bp))
+            if (GET_SIZE(HDRP(bp)) >= RELEASE_THRESHOLD)
+                purge_block(bp);
+    }
+    for (cur = TREE_ROOT; (bp = tree_walk(&cur)) != NULL; )
+        if (GET_SIZE(HDRP(bp)) >= RELEASE_THRESHOLD)
+            purge_block(bp);
+    dirty = 0;
+}
+
+/*
+ * purge_block - Release the pages of large free block bp if it stayed
+ *               unchanged since the previous purge, otherwise mark it
+ */
+static void purge_block(char *bp) {
+    unsigned mark = GET(PURGE_MARK(bp));
+
+    if (mark == PURGE_DONE)
+        return;
+    if (mark == purgeCount - 1) {
+        mem_release(bp + 2*DSIZE, FTRP(bp));
+        PUT(PURGE_MARK(bp), PURGE_DONE);
+    }
+    else
+        PUT(PURGE_MARK(bp), purgeCount);
+}
+#endif
+
+/*
+ * carve - Allocate the asize byte block whose payload starts at bp inside
+ *         free block fp, which has already been taken off its list. The
+ *         slack in front of and behind the block is freed again
+ */
+static void carve(void *fp, void *bp, size_t asize) {
+    size_t fsize = GET_SIZE(HDRP(fp));
+    size_t front = (char *)bp - (char *)fp;
+    unsigned prev = GET_PREV(HDRP(fp));
+
+    if (front) {
+        PUT(HDRP(fp), PACK(front, prev, 0));
+        if (front > MINSIZE)
+            PUT(FTRP(fp), PACK(front, prev, 0));
+        list_insert(fp);
+        prev = MINI_BIT(front);
+    }
+    PUT(HDRP(bp), PACK(fsize - front, prev, 1));
+    SET_PREV_INFO(HDRP(NEXT_BLKP(bp)), PREV_ALLOC | MINI_BIT(fsize - front));
+    shrink(bp, asize);
+}
+
+/*
+ * alloc_aligned - Allocate an asize byte block whose payload is aligned to
+ *                 align bytes out of a free block or, if no free block can
+ *                 hold it, out of the end of the heap, using the last free
+ *                 block and extending the heap as needed
+ */
+static char *alloc_aligned(size_t asize, size_t align) {
+    char *bp;
+    char *fp = find_aligned_fit(asize, align, &bp);
+
+    if (fp == NULL && quickBytes) {
+        quick_flush();
+        fp = find_aligned_fit(asize, align, &bp);
+    }
+    if (fp == NULL) {
+        fp = GET_PREV_ALLOC(HDRP(epilogue)) ? epilogue : PREV_BLKP(epilogue);
+        bp = align_fit(fp, align);
+        if (bp + asize > epilogue &&
+            (fp = extend_heap(bp + asize - epilogue)) == NULL)
+            return NULL;
+    }
+    list_remove(fp);
+    carve(fp, bp, asize);
+    return bp;
+}
+
+/*
+ * grow_size - Bytes to extend the heap by for an asize byte block that
+ *             fits nowhere. Adapts growSize to how often the heap runs
+ *             out, bounds it by the heap size and only adds the shortfall
+ *             to a free last block
+ */
+static size_t grow_size(size_t asize) {
+    unsigned long fits = fitCount - growMark;
+    size_t last = 0, share;
+
+    growMark = fitCount;
+    if (fits < GROW_BURST)
+        growSize = MIN(2 * growSize, GROW_MAX);
+    else if (fits >= GROW_IDLE)
+        growSize = MAX(growSize >> MIN(fits / GROW_IDLE, 16), CHUNKSIZE);
+
+    share = (size_t)(epilogue - heap_listp) / GROW_SHARE & ~(size_t)(CHUNKSIZE - 1);
+    if (!GET_PREV_ALLOC(HDRP(epilogue)))
+        last = GET_SIZE(HDRP(PREV_BLKP(epilogue)));
+    /* A last block that does not fit is smaller than asize, but never
+       extend by less than a block */
+    return MAX(asize, MIN(growSize, MAX(share, CHUNKSIZE))) - MIN(last, asize - MINSIZE);
+}
+
+/*
+ * align_fit - First address in free block fp aligned to align bytes that
+ *             leaves either nothing or room for a whole free block in front
+ */
+static char *align_fit(char *fp, size_t align) {
+    char *bp = (char *)(((size_t)fp + align - 1) & ~(align - 1));
+
+    if (bp != fp && bp - fp < MINSIZE)
+        bp += align;
+    return bp;
+}
+
+/*
+ * adjust_size - Block size needed for a payload of size bytes, including
+ *               the header, the canary and alignment
+ */
+static size_t adjust_size(size_t size) {
+    if (size + WSIZE + CANARY_SIZE <= MINSIZE)
+        return MINSIZE;
+    return ALIGN(size+WSIZE+CANARY_SIZE);
+}
+
+/*
+ * canary_fail - Report an overflow past the end of block bp and abort
+ */
+static void canary_fail(void *bp) {
+    fprintf(stderr, "mm: canary of block %p clobbered, heap overflow\n", bp);
+    abort();
+}
+
+/*
+ * junk_byte - Next byte to fill freed payloads with
+ */
+static int junk_byte(void) {
+    junkSeed ^= junkSeed << 13;
+    junkSeed ^= junkSeed >> 17;
+    junkSeed ^= junkSeed << 5;
+    return junkSeed & 0xff;
+}
+
+/* 
+ * find_fit - Find a fit for a block with asize bytes. Only the bucket of
+ *            asize itself can hold blocks that are too small; every block
+ *            in a larger non-empty bucket fits, and those are found
+ *            through freeMap without touching the empty lists. The tree
+ *            of large blocks always gives the best fit
+ */
+static void *find_fit(size_t asize) {
+    int index = size_class(asize);
+    unsigned long nonempty = freeMap & (~0UL << index);
+
+    dbg_printf("Find list size %ld from list %d map %lx.\n", asize, index, freeMap);
+    fitCount++;
+
+    while (nonempty) {
+        index = __builtin_ctzl(nonempty);
+        nonempty &= nonempty - 1;
+        if (index == TREE_CLASS) {
+            probeCount++;
+            return tree_fit(asize);
+        }
+        void *list = freeLists + index*WSIZE;
+#if FIT_POLICY == FIRST_FIT
+        for (void *bp = NEXT(list); bp; bp = NEXT(bp)) {
+            probeCount++;
             if (GET_SIZE(HDRP(bp)) >= asize) {
                 return bp;
             }
-            curr = NEXT(curr);
         }
+#else
+        void *best = NULL;
+        size_t best_size = 0;
+#if FIT_POLICY == GOOD_FIT
+        int candidates = 0;
+#endif
+        for (void *bp = NEXT(list); bp; bp = NEXT(bp)) {
+            size_t size = GET_SIZE(HDRP(bp));
+            probeCount++;
+            if (size < asize) 
+                continue;
+            if (size == asize)              /* cannot do better than exact */
+                return bp;
+            if (!best || size < best_size) {
+                best = bp;
+                best_size = size;
+            }
+#if FIT_POLICY == GOOD_FIT
+            if (++candidates >= FIT_CANDIDATES)
+                break;
+#endif
+        }
+        if (best)
+            return best;
+#endif
     }
 
     return NULL; /* No fit */
 
 }
 
+/* 
+ * find_aligned_fit - Find a free block that holds an asize byte block whose
+ *                    payload is aligned to align bytes. Return the free
+ *                    block and store the aligned payload address in *bpp
+ */
+static void *find_aligned_fit(size_t asize, size_t align, char **bpp) {
+    int index = size_class(asize);
+    unsigned long nonempty = freeMap & (~0UL << index);
+
+    while (nonempty) {
+        index = __builtin_ctzl(nonempty);
+        nonempty &= nonempty - 1;
+        void *list = freeLists + index*WSIZE;
+        char *bp = index == TREE_CLASS ? tree_next(asize, NULL) : NEXT(list);
+        for (; bp; bp = index == TREE_CLASS ? tree_next(GET_SIZE(HDRP(bp)), bp) : NEXT(bp)) {
+            char *ap = align_fit(bp, align);
+            if (ap + asize <= bp + GET_SIZE(HDRP(bp))) {
+                *bpp = ap;
+                return bp;
+            }
+        }
+    }
+
+    return NULL; /* No fit */
+}
+
 /* 
  *  List Routines
  */
 
 /* 
- * list_insert - insert a free block into list
+ * list_insert - insert a free block into list. Mini blocks stay off the
+ *               lists, only their bytes are counted
  */
 static void *list_insert(void *bp) {
     dbg_printf("List insert size %d on address %p.\n", GET_SIZE(HDRP(bp)),bp);
-    void *list = find_list(GET_SIZE(HDRP(bp)));
-
-    SET_NEXT(bp, NEXT(list));
+    size_t size = GET_SIZE(HDRP(bp));
+    freeBytes += size;
+    if (size == MINSIZE)
+        return bp;
+#if RELEASE_THRESHOLD
+    if (size >= RELEASE_THRESHOLD)
+        PUT(PURGE_MARK(bp), 0);
+#endif
+    if (size >= LARGE_LIMIT) {
+        tree_insert(bp);
+        return bp;
+    }
+    int index = size_class(size);
+    void *list = freeLists + index*WSIZE;
+    void *next = NEXT(list);
+
+    SET_NEXT(bp, next);
+    SET_PREV(bp, list);
+    if (next)
+        SET_PREV(next, bp);
     SET_NEXT(list, bp);
+    freeMap |= 1UL << index;
 
     return bp;
 }
 
 /*
- * list_remove - remove a block from free list
+ * list_remove - remove a block from free list in constant time. The
+ *               predecessor may be a list head, which only has a next field
  */
 static void list_remove(void *bp) {
     dbg_printf("List remove size %d on address %p.\n", GET_SIZE(HDRP(bp)),bp);
-    void *list = find_list(GET_SIZE(HDRP(bp)));
-
-    void *curr = list;
-    while (NEXT(curr) && NEXT(curr) != bp) {
-        curr = NEXT(curr);
-    }
-    if (!curr) {
+    size_t size = GET_SIZE(HDRP(bp));
+    freeBytes -= size;
+    if (size == MINSIZE)
+        return;
+    if (size >= LARGE_LIMIT) {
+        tree_remove(bp);
         return;
     }
-    SET_NEXT(curr, NEXT(bp));
+    void *next = NEXT(bp);
+    void *prev = PREV(bp);
+
+    SET_NEXT(prev, next);
+    if (next)
+        SET_PREV(next, prev);
+    else if ((char *)prev < heap_listp)     /* bp was the only block in its list */
+        freeMap &= ~(1UL << (((char *)prev - freeLists) / WSIZE));
+}
+
+/* 
+ * size_class - map a block size to its free list index in constant time.
+ *              Exact classes below SMALL_LIMIT, then SL_COUNT sub-classes
+ *              per power of two up to LARGE_LIMIT, then one final class
+ */
+static int size_class(size_t size) {
+    if (size < SMALL_LIMIT)
+        return size / ALIGNMENT;
+    if (size >= LARGE_LIMIT)
+        return FREELIST_COUNT-1;
+
+    int fl = 63 - __builtin_clzl(size);
+    int sl = (size >> (fl - SL_BITS)) & (SL_COUNT - 1);
+    return SMALL_CLASSES + ((fl - SMALL_LOG) << SL_BITS) + sl;
 }
 
 /* 
- * find_list - find the smallest list that can contain a free block that fits the size required
- * 8 Lists in heap - lists start from 2^4 to 2^15, each list holds [2^x, 2^(x+1) - 1], final list [2^15, inf)
+ * find_list - find the list that holds free blocks of the given size
  */
 static void *find_list(size_t size) {
-    if (size >= (1 << 15)) 
-        return freeLists+(FREELIST_COUNT-1)*DSIZE;
+    return freeLists + size_class(size)*WSIZE;
+}
+
+/* 
+ * class_min - smallest block size that maps to free list index, the
+ *             inverse of size_class
+ */
+static size_t class_min(int index) {
+    if (index < SMALL_CLASSES)
+        return index * ALIGNMENT;
+    if (index == FREELIST_COUNT-1)
+        return LARGE_LIMIT;
+
+    int fl = SMALL_LOG + ((index - SMALL_CLASSES) >> SL_BITS);
+    int sl = (index - SMALL_CLASSES) & (SL_COUNT - 1);
+    return ((size_t)1 << fl) + ((size_t)sl << (fl - SL_BITS));
+}
+
+/* 
+ *  Tree Routines
+ */
+
+/*
+ * splay - Top-down splay of the subtree rooted at t around the key
+ *         (size, addr). Return the new root, which is the node with that
+ *         key if there is one and otherwise its predecessor or successor
+ */
+static char *splay(char *t, size_t size, char *addr) {
+    char *l = NULL, *r = NULL;          /* last nodes of the side trees */
+    char *lroot = NULL, *rroot = NULL;
+    char *y;
+
+    if (t == NULL)
+        return NULL;
+
+    for (;;) {
+        if (KEY_BEFORE(size, addr, t)) {
+            if ((y = LEFT(t)) == NULL)
+                break;
+            if (KEY_BEFORE(size, addr, y)) {        /* rotate right */
+                SET_LEFT(t, RIGHT(y));
+                SET_RIGHT(y, t);
+                t = y;
+                if ((y = LEFT(t)) == NULL)
+                    break;
+            }
+            if (r)                                  /* link right */
+                SET_LEFT(r, t);
+            else
+                rroot = t;
+            r = t;
+            t = y;
+        }
+        else if (KEY_AFTER(size, addr, t)) {
+            if ((y = RIGHT(t)) == NULL)
+                break;
+            if (KEY_AFTER(size, addr, y)) {         /* rotate left */
+                SET_RIGHT(t, LEFT(y));
+                SET_LEFT(y, t);
+                t = y;
+                if ((y = RIGHT(t)) == NULL)
+                    break;
+            }
+            if (l)                                  /* link left */
+                SET_RIGHT(l, t);
+            else
+                lroot = t;
+            l = t;
+            t = y;
+        }
+        else
+            break;
+    }
+
+    if (l) {                                        /* reassemble */
+        SET_RIGHT(l, LEFT(t));
+        SET_LEFT(t, lroot);
+    }
+    if (r) {
+        SET_LEFT(r, RIGHT(t));
+        SET_RIGHT(t, rroot);
+    }
+    return t;
+}
+
+/*
+ * tree_insert - Insert a free block into the tree as its new root
+ */
+static void tree_insert(char *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    char *t = splay(TREE_ROOT, size, bp);
+
+    if (t == NULL) {
+        SET_LEFT(bp, NULL);
+        SET_RIGHT(bp, NULL);
+    }
+    else if (KEY_BEFORE(size, bp, t)) {
+        SET_LEFT(bp, LEFT(t));
+        SET_RIGHT(bp, t);
+        SET_LEFT(t, NULL);
+    }
+    else {
+        SET_RIGHT(bp, RIGHT(t));
+        SET_LEFT(bp, t);
+        SET_RIGHT(t, NULL);
+    }
+    SET_ROOT(bp);
+    freeMap |= 1UL << TREE_CLASS;
+}
+
+/*
+ * tree_remove - Remove a free block from the tree. Once bp is splayed to
+ *               the root, splaying its left subtree around bp brings up
+ *               the largest node there, which has room for a right child
+ */
+static void tree_remove(char *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    char *t = splay(TREE_ROOT, size, bp);
+    char *x;
+
+    if (LEFT(t) == NULL)
+        x = RIGHT(t);
+    else {
+        x = splay(LEFT(t), size, bp);
+        SET_RIGHT(x, RIGHT(t));
+    }
+    SET_ROOT(x);
+    if (x == NULL)
+        freeMap &= ~(1UL << TREE_CLASS);
+}
+
+/*
+ * tree_fit - Return the smallest block of at least asize bytes, the one
+ *            at the lowest address among equals, or NULL if none fits
+ */
+static char *tree_fit(size_t asize) {
+    char *t = splay(TREE_ROOT, asize, NULL);
+
+    SET_ROOT(t);
+    if (t == NULL || GET_SIZE(HDRP(t)) >= asize)
+        return t;
+    if ((t = RIGHT(t)) != NULL)
+        while (LEFT(t))
+            t = LEFT(t);
+    return t;
+}
 
-    void *list = freeLists;
-    size >>= 4; 
-    while (size > 1) {
-        list += DSIZE;
-        size >>= 1;
+/*
+ * tree_next - Return the first block ordered after the key (size, addr)
+ *             without reshaping the tree, so that callers can walk it in
+ *             order from a given key. Each step descends from the root,
+ *             so use tree_walk to visit the whole tree.
+ *             A NULL addr finds the first block of size bytes
+ */
+static char *tree_next(size_t size, char *addr) {
+    char *next = NULL;
+
+    for (char *t = TREE_ROOT; t; ) {
+        if (KEY_BEFORE(size, addr, t)) {
+            next = t;
+            t = LEFT(t);
+        }
+        else
+            t = RIGHT(t);
+    }
+    return next;
+}
+
+/*
+ * tree_walk - Return the next block of an in-order walk of the tree that
+ *             starts with *cur set to the root, or NULL at the end. The
+ *             walk threads the tree through the right links of nodes left
+ *             of the current one and undoes that as it goes, so it takes
+ *             linear time and no stack. It must run to the end, and the
+ *             caller must not change the links of the tree meanwhile
+ */
+static char *tree_walk(char **cur) {
+    char *t = *cur, *p;
+
+    while (t) {
+        if (LEFT(t) == NULL) {
+            *cur = RIGHT(t);
+            return t;
+        }
+        for (p = LEFT(t); RIGHT(p) && RIGHT(p) != t; p = RIGHT(p))
+            ;
+        if (RIGHT(p) == NULL) {             /* thread, then go left */
+            SET_RIGHT(p, t);
+            t = LEFT(t);
+        }
+        else {                              /* left subtree done, unthread */
+            SET_RIGHT(p, NULL);
+            *cur = RIGHT(t);
+            return t;
+        }
+    }
+    *cur = NULL;
+    return NULL;
+}
+
+#if SLAB_ALLOC
+/* 
+ *  Slab Routines
+ */
+
+/*
+ * slab_alloc - Hand out an object from the first partial slab of the
+ *              class of size, making a new slab if there is none. NULL
+ *              while the class is warming up, see SLAB_WARMUP
+ */
+static void *slab_alloc(size_t size) {
+    int cls = (size - 1) / ALIGNMENT;
+    char *list = slabLists + cls*WSIZE;
+    char *s = NEXT(list);
+    unsigned off;
+
+#if SLAB_WARMUP
+    if (slabSeen[cls] < SLAB_WARMUP) {
+        slabSeen[cls]++;
+        return NULL;
+    }
+#endif
+    if (s == NULL && (s = slab_new(cls)) == NULL)
+        return NULL;
+
+    if ((off = GET(SLAB_FREE(s))) != 0) {
+        PUT(SLAB_FREE(s), GET(s + off));
+    }
+    else {
+        off = GET(SLAB_BUMP(s));
+        PUT(SLAB_BUMP(s), off + SLAB_OBJ(cls));
+    }
+
+    /* full slabs leave the partial list until an object comes back */
+    PUT(SLAB_USED(s), GET(SLAB_USED(s)) + 1);
+    if (GET(SLAB_USED(s)) == SLAB_CAP(cls)) {
+        char *next = TO_PTR(GET(SLAB_NEXT(s)));
+        SET_NEXT(list, next);
+        if (next)
+            PUT(SLAB_PREV(next), TO_OFF(list));
+    }
+
+    dbg_printf("Slab alloc size %zd on address %p.\n", size, s + off);
+    return s + off;
+}
+
+/*
+ * slab_free - Return an object to its slab. An empty slab goes back to
+ *             the heap unless it is the only slab left in its class
+ */
+static void slab_free(void *bp) {
+    char *s = SLAB_BASE(bp);
+    int cls = GET(SLAB_CLASS(s));
+    char *list = slabLists + cls*WSIZE;
+    unsigned used = GET(SLAB_USED(s));
+
+    PUT(bp, GET(SLAB_FREE(s)));
+    PUT(SLAB_FREE(s), (char *)bp - s);
+    PUT(SLAB_USED(s), used - 1);
+
+    if (used == SLAB_CAP(cls)) {            /* was full: back on the list */
+        char *next = NEXT(list);
+        PUT(SLAB_NEXT(s), TO_OFF(next));
+        PUT(SLAB_PREV(s), TO_OFF(list));
+        if (next)
+            PUT(SLAB_PREV(next), TO_OFF(s));
+        SET_NEXT(list, s);
+    }
+
+    if (used == 1 && (NEXT(list) != s || GET(SLAB_NEXT(s)))) {
+        char *prev = TO_PTR(GET(SLAB_PREV(s)));
+        char *next = TO_PTR(GET(SLAB_NEXT(s)));
+        if (prev == list)
+            SET_NEXT(list, next);
+        else
+            PUT(SLAB_NEXT(prev), TO_OFF(next));
+        if (next)
+            PUT(SLAB_PREV(next), TO_OFF(prev));
+
+        slabMap[SLAB_PAGE(s) / 64] &= ~(1UL << (SLAB_PAGE(s) % 64));
+        free_block(s);
+    }
+}
+
+/*
+ * slab_new - Allocate a SLAB_SIZE aligned slab and put it on the partial
+ *            list of class cls. Slabs beyond the reach of slabMap are
+ *            given back
+ */
+static char *slab_new(int cls) {
+    char *s = alloc_aligned(SLAB_SIZE, SLAB_SIZE);
+
+    if (s == NULL)
+        return NULL;
+    if (SLAB_PAGE(s) >= MAX_HEAP / SLAB_SIZE) {
+        free_block(s);
+        return NULL;
     }
-    return list;
-}
\ No newline at end of file
+
+    PUT(SLAB_CLASS(s), cls);
+    PUT(SLAB_USED(s), 0);
+    PUT(SLAB_FREE(s), 0);
+    PUT(SLAB_BUMP(s), SLAB_HDR);
+    slabMap[SLAB_PAGE(s) / 64] |= 1UL << (SLAB_PAGE(s) % 64);
+
+    char *list = slabLists + cls*WSIZE;
+    char *next = NEXT(list);
+    PUT(SLAB_NEXT(s), TO_OFF(next));
+    PUT(SLAB_PREV(s), TO_OFF(list));
+    if (next)
+        PUT(SLAB_PREV(next), TO_OFF(s));
+    SET_NEXT(list, s);
+
+    dbg_printf("New slab of class %d on address %p.\n", cls, s);
+    return s;
+}
+#endif
+
+#if MMAP_THRESHOLD
+/* 
+ *  Mapped Block Routines
+ */
+
+/*
+ * map_alloc - Give a huge request its own region and put it on mapList.
+ *             Return NULL if size is too large to round to whole pages
+ */
+static void *map_alloc(size_t size) {
+    size_t page = mem_pagesize();
+    size_t rsize;
+    char *bp;
+
+    if (size > SIZE_MAX - MAP_HDR - page - MAP_GUARD)
+        return NULL;
+    rsize = (size + MAP_HDR + page - 1) & ~(page - 1);
+    if ((bp = mem_map(rsize + MAP_GUARD)) == NULL)
+        return NULL;
+#if HARDEN_GUARD
+    mem_guard(bp + rsize, MAP_GUARD);
+    bp += rsize - ALIGN(size);
+#else
+    bp += MAP_HDR;
+#endif
+    MAP_SIZE(bp) = rsize + MAP_GUARD;
+    MAP_NEXT(bp) = mapList;
+    MAP_PREV(bp) = NULL;
+    if (mapList)
+        MAP_PREV(mapList) = bp;
+    mapList = bp;
+
+    dbg_printf("Map size %zd on address %p.\n", rsize, bp);
+    return bp;
+}
+
+/*
+ * map_realloc - Resize a mapped block in place or let mem_remap move it.
+ *               A block that shrinks below MMAP_THRESHOLD moves to the heap
+ */
+static void *map_realloc(void *bp, size_t size) {
+    size_t page = mem_pagesize();
+    size_t rsize;
+    char *newp;
+
+    if (size > SIZE_MAX - MAP_HDR - page - MAP_GUARD)
+        return NULL;
+    rsize = (size + MAP_HDR + page - 1) & ~(page - 1);
+    if (size < MMAP_THRESHOLD) {
+        if ((newp = malloc(size)) == NULL)
+            return NULL;
+        memcpy(newp, bp, size);
+        map_free(bp);
+        return newp;
+    }
+#if HARDEN_GUARD
+    /* The payload has to keep ending at the guard page */
+    char *end = MAP_BASE(bp) + MAP_SIZE(bp) - MAP_GUARD;
+    if ((char *)bp + ALIGN(size) == end)
+        return bp;
+    if ((newp = map_alloc(size)) == NULL)
+        return NULL;
+    memcpy(newp, bp, MIN(size, (size_t)(end - (char *)bp)));
+    map_free(bp);
+    return newp;
+#endif
+    if (rsize == MAP_SIZE(bp))
+        return bp;
+
+    if ((newp = mem_remap((char *)bp - MAP_HDR, rsize)) == NULL)
+        return NULL;
+    newp += MAP_HDR;
+    MAP_SIZE(newp) = rsize;
+    if (MAP_NEXT(newp))
+        MAP_PREV(MAP_NEXT(newp)) = newp;
+    if (MAP_PREV(newp))
+        MAP_NEXT(MAP_PREV(newp)) = newp;
+    else
+        mapList = newp;
+    return newp;
+}
+
+/*
+ * map_free - Take a mapped block off mapList and unmap its region
+ */
+static void map_free(void *bp) {
+    if (MAP_NEXT(bp))
+        MAP_PREV(MAP_NEXT(bp)) = MAP_PREV(bp);
+    if (MAP_PREV(bp))
+        MAP_NEXT(MAP_PREV(bp)) = MAP_NEXT(bp);
+    else
+        mapList = MAP_NEXT(bp);
+    mem_unmap(MAP_BASE(bp));
+}
+#endif
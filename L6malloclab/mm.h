@@ -7,6 +7,9 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
 
 #else
 
@@ -15,10 +18,94 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
 
 #endif
 
 extern int mm_init(void);
 
+/* Options for mm_mallopt */
+#define MM_DEFER_COALESCE   1   /* park small frees and coalesce in batches */
+#define MM_CHECK_SLICE      2   /* blocks checked per call, 0 for none */
+#define MM_CHECK_FULL       3   /* run mm_checkheap every so many calls */
+#define MM_PROFILE          4   /* mean bytes between profile samples, 0 for off */
+
+extern int mm_mallopt(int param, int value);
+
+/* Allocator statistics filled in by mm_info. Sizes are in bytes and
+ * include block headers. Slabs count as allocated blocks */
+#define MM_INFO_CLASSES     64
+
+typedef struct {
+    size_t heap;            /* size of the heap */
+    size_t mapped;          /* bytes in regions from mem_map */
+    size_t in_use;          /* allocated heap blocks plus mapped regions */
+    size_t free_bytes;      /* free heap blocks */
+    size_t parked;          /* blocks parked on the quick lists */
+    size_t largest_free;    /* largest free block */
+    double fragmentation;   /* share of free bytes outside the largest block */
+    int classes;            /* number of size classes */
+    size_t class_min[MM_INFO_CLASSES];  /* smallest block of each class */
+    size_t class_free[MM_INFO_CLASSES]; /* free bytes in each class */
+    unsigned long extends;  /* extend_heap calls */
+    unsigned long fits;     /* find_fit calls */
+    unsigned long probes;   /* free blocks looked at by find_fit */
+} mm_info_t;
+
+extern void mm_info(mm_info_t *info);
+extern int mm_size_class(size_t size);
+
+/* Sampling heap profiler in mm-prof.c, enabled with MM_PROFILE. A dump
+ * is a pprof text heap profile of the sampled blocks still allocated */
+extern int mm_prof_dump(const char *path);
+extern void mm_prof_dump_at(const char *path, int sig);
+
+/* Hooks called by mm.c */
+extern int mm_prof_live;
+extern long mm_prof_start(int rate);
+extern long mm_prof_sample(void *bp, size_t size);
+extern void mm_prof_forget(void *bp);
+
+/* Trace recorder in mm-trace.c. Writes every request to mm.c as an
+ * mdriver trace, and counts allocations per size class */
+extern int mm_trace_start(const char *path);
+extern int mm_trace_stop(void);
+extern void mm_trace_hist(unsigned long *class_allocs, size_t *class_bytes);
+
+/* Hooks called by mm.c */
+extern int mm_trace_on;
+extern void mm_trace_alloc(void *bp, size_t size, size_t align);
+extern void mm_trace_realloc(void *old, void *bp, size_t size);
+extern void mm_trace_free(void *bp);
+
+/* Region allocator in mm-region.c. Objects of a region are freed all at
+ * once: by mm_region_reset and mm_region_destroy, or by mm_region_release
+ * for those allocated since a mark */
+typedef struct mm_region mm_region_t;
+typedef struct {
+    struct mm_chunk *tail, *cur, *large;
+    char *ptr;
+} mm_region_mark_t;
+
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *r, size_t size);
+extern mm_region_mark_t mm_region_mark(mm_region_t *r);
+extern void mm_region_release(mm_region_t *r, mm_region_mark_t m);
+extern void mm_region_reset(mm_region_t *r);
+extern void mm_region_destroy(mm_region_t *r);
+extern void mm_region_trim(void);
+
+/* Hook called by mm.c */
+extern void mm_region_heap_init(void);
+
 /* This is largely for debugging. */
 extern void mm_checkheap(int lineno);
+
+/* Thread-safe front end in mm-mt.c. mm_mt_init replaces mm_init */
+extern int mm_mt_init(void);
+extern void *mm_mt_malloc(size_t size);
+extern void mm_mt_free(void *ptr);
+extern void *mm_mt_realloc(void *ptr, size_t size);
+extern void *mm_mt_calloc(size_t nmemb, size_t size);
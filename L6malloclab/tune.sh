@@ -0,0 +1,81 @@
+#!/bin/bash
+#
+# tune.sh - Sweep the heap geometry of mm.c and report the Pareto front of
+#     utilization against throughput over the default traces of config.h.
+#
+#     Every point of the grid CHUNKS x MINS x CLASSES is built into its own
+#     driver under $TUNE_DIR and run with "mdriver -v 2". A class layout
+#     "s:l" sets SL_BITS=s and LARGE_LOG=l, which together fix
+#     FREELIST_COUNT; layouts needing more than 64 lists fail to build and
+#     are skipped. A point is marked * when no other point has both higher
+#     utilization and higher throughput.
+#
+#     usage: ./tune.sh [mdriver args]     (or make tune)
+#
+#     Override the grid from the environment, e.g.
+#         CHUNKS="4096 65536" MINS=8 CLASSES="2:15" ./tune.sh -t traces
+#
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-Wall -O3 -g -std=gnu99 -DDRIVER -pthread"}
+LIBOBJS=${LIBOBJS:-"mm-mt.o mm-prof.o mm-region.o mm-trace.o memlib.o fsecs.o fcyc.o clock.o ftimer.o"}
+LIBS=${LIBS:-"-rdynamic -lm -ldl"}
+TUNE_DIR=${TUNE_DIR:-.tune}
+
+CHUNKS=${CHUNKS:-"4096 16384 65536"}
+MINS=${MINS:-"8 16"}
+CLASSES=${CLASSES:-"1:15 2:15 2:18 3:12"}
+
+mkdir -p $TUNE_DIR || exit 1
+results=$TUNE_DIR/results
+
+echo "chunk  min  classes  lists  util%  Kops" > $results
+for chunk in $CHUNKS; do
+    for min in $MINS; do
+        for cls in $CLASSES; do
+            sl=${cls%:*}
+            large=${cls#*:}
+            lists=$(( 128 / 8 + (large - 7) * (1 << sl) + 1 ))
+            name=$TUNE_DIR/mdriver-$chunk-$min-$sl-$large
+            flags="-DCHUNKSIZE=$chunk -DMINSIZE=$min -DSL_BITS=$sl -DLARGE_LOG=$large"
+
+            printf "%-6s %-4s %-8s " $chunk $min $cls
+            if ! $CC $CFLAGS $flags -c -o $name.o mm.c 2> $name.log ||
+               ! $CC $CFLAGS -o $name mdriver.o $name.o $LIBOBJS $LIBS 2>> $name.log; then
+                echo "does not build, see $name.log"
+                continue
+            fi
+
+            # Totals line, only printed if every trace ran correctly:
+            # util traces, perf traces, util, ops, secs, Kops
+            total=$($name -v 2 "$@" | grep -E "^ *[0-9]+ +[0-9]+ ")
+            if [ -z "$total" ]; then
+                echo "failed, rerun $name -V"
+                continue
+            fi
+            util=$(echo $total | awk '{ sub("%", "", $3); print $3 }')
+            kops=$(echo $total | awk '{ print $6 }')
+            echo "util $util%, $kops Kops"
+            printf "%-6s %-4s %-8s %5d  %5s  %s\n" \
+                $chunk $min $cls $lists $util $kops >> $results
+        done
+    done
+done
+
+# Mark the points no other point beats on both axes, best utilization first
+echo
+(head -1 $results; tail -n +2 $results | sort -k5,5nr -k6,6nr) | awk '
+NR == 1 { print "  " $0; next }
+{
+    line[NR] = $0; util[NR] = $5; kops[NR] = $6
+}
+END {
+    for (i = 2; i <= NR; i++) {
+        front = 1
+        for (j = 2; j <= NR; j++)
+            if (util[j] >= util[i] && kops[j] >= kops[i] &&
+                (util[j] > util[i] || kops[j] > kops[i]))
+                front = 0
+        print (front ? "* " : "  ") line[i]
+    }
+}'